@@ -0,0 +1,97 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "utils.h"
+
+struct arena_block_s {
+  arena_block_t *next;
+  size_t capacity;
+  size_t used;
+  alignas (max_align_t) char data[];
+};
+
+/*
+ * Prepare `arena` to allocate memory by blocks of `block_size` bytes.
+ * Nothing is allocated until the first call to arena_alloc().
+ */
+void
+arena_init (arena_t *arena, size_t block_size)
+{
+  arena->first = NULL;
+  arena->current = NULL;
+  arena->block_size = block_size;
+}
+
+/*
+ * Get `len` bytes of uninitialized memory, suitably aligned for any type.
+ * It stays valid until the next arena_reset() or arena_free().
+ *
+ * Blocks are used in turn. When the next one is too small, a bigger block
+ * is inserted before it.
+ */
+void *
+arena_alloc (arena_t *arena, size_t len)
+{
+  arena_block_t *block = arena->current;
+
+  len = (len + alignof (max_align_t) - 1) & ~(alignof (max_align_t) - 1);
+
+  if (!block || len > block->capacity - block->used)
+    {
+      arena_block_t *next = block ? block->next : NULL;
+
+      if (next && len <= next->capacity)
+        block = next;
+      else
+        {
+          size_t capacity = len > arena->block_size ? len : arena->block_size;
+          block = xrealloc (NULL, sizeof (*block) + capacity);
+          block->capacity = capacity;
+          block->next = next;
+
+          if (arena->current)
+            arena->current->next = block;
+          else
+            arena->first = block;
+        }
+
+      block->used = 0;
+      arena->current = block;
+    }
+
+  void *mem = block->data + block->used;
+  block->used += len;
+  return mem;
+}
+
+/*
+ * Release all memory allocated from `arena`, in constant time.
+ */
+void
+arena_reset (arena_t *arena)
+{
+  arena->current = arena->first;
+  if (arena->first)
+    arena->first->used = 0;
+}
+
+/*
+ * Give the blocks of `arena` back to the system.
+ */
+void
+arena_free (arena_t *arena)
+{
+  arena_block_t *block = arena->first;
+
+  while (block)
+    {
+      arena_block_t *next = block->next;
+      free (block);
+      block = next;
+    }
+
+  arena->first = NULL;
+  arena->current = NULL;
+}
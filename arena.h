@@ -0,0 +1,41 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block_s arena_block_t;
+
+/*
+ * Bump allocator for short lived memory, like the directory entries of a
+ * dump loop iteration. Everything is released at once by arena_reset(),
+ * which keeps the blocks around for the next allocations.
+ */
+typedef struct {
+  arena_block_t *first;
+  arena_block_t *current;
+  size_t block_size;
+} arena_t;
+
+/*
+ * Prepare `arena` to allocate memory by blocks of `block_size` bytes.
+ * Nothing is allocated until the first call to arena_alloc().
+ */
+void arena_init (arena_t *arena, size_t block_size);
+
+/*
+ * Get `len` bytes of uninitialized memory, suitably aligned for any type.
+ * It stays valid until the next arena_reset() or arena_free().
+ */
+void *arena_alloc (arena_t *arena, size_t len);
+
+/*
+ * Release all memory allocated from `arena`, in constant time.
+ */
+void arena_reset (arena_t *arena);
+
+/*
+ * Give the blocks of `arena` back to the system.
+ */
+void arena_free (arena_t *arena);
+
+#endif
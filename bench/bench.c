@@ -0,0 +1,727 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define READ_BUFFER_SIZE (1024 * 1024)
+#define SERVER_START_TIMEOUT_MS 10000
+#define MAX_ARGS 8
+
+extern char **environ;
+
+typedef struct {
+  const char *zim_dump;
+  size_t runs;
+  size_t jobs;
+  size_t cold_lookups;
+  size_t warm_lookups;
+  size_t batch_lookups;
+  uint64_t seed;
+} bench_options_t;
+
+/*
+ * Urls of an archive, as listed by zim_dump.
+ */
+typedef struct {
+  char **items;
+  size_t len;
+} url_list_t;
+
+static void
+usage (const char *progname)
+{
+  printf (
+    "%s [-z <zim_dump>] [-r <runs>] [-j <jobs>] [-n <cold lookups>]\n"
+    "    [-w <warm lookups>] [-b <batch lookups>] [-S <seed>] <zimfile>...\n"
+    "\n"
+    "Time zim_dump on each zimfile and print results on STDOUT, one JSON\n"
+    "object per line and benchmark. Progress goes to STDERR.\n"
+    "\n"
+    "`list`, `dump`, `dump_cluster_order` and `dump_parallel` run `zim_dump`,\n"
+    "`zim_dump -a`, `zim_dump -a -c` and `zim_dump -a -j <jobs>` (default: 4)\n"
+    "<runs> times (default: 3), and report the median and fastest run, with\n"
+    "entries and output megabytes per second for the median.\n"
+    "\n"
+    "`lookup_cold` starts `zim_dump <zimfile> <url>` for <cold lookups> random\n"
+    "urls (default: 100), `lookup_warm` asks a `zim_dump --serve` instance\n"
+    "for <warm lookups> random urls (default: 1000), one at a time : they\n"
+    "report latency percentiles in milliseconds. `batch` times a single\n"
+    "`zim_dump --batch` run for <batch lookups> random urls (default: 10000).\n"
+    "\n"
+    "The page cache is not dropped, so `cold` means a new process, not\n"
+    "reads from the disk. Urls are drawn from <seed> (default: 1).\n"
+    "<zim_dump> defaults to ./zim_dump.\n",
+  progname);
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+next_random (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double first = *(const double *) a;
+  double second = *(const double *) b;
+  return (first > second) - (first < second);
+}
+
+/*
+ * Nearest-rank percentile of the sorted `values`.
+ */
+static double
+percentile (const double *values, size_t len, double p)
+{
+  size_t rank = (size_t) (p / 100 * len + 0.999999);
+  if (rank == 0) rank = 1;
+  if (rank > len) rank = len;
+  return values[rank - 1];
+}
+
+static void
+print_json_string (const char *str)
+{
+  putchar ('"');
+  for (const char *c = str; *c; c++)
+    {
+      if (*c == '"' || *c == '\\')
+        printf ("\\%c", *c);
+      else if ((unsigned char) *c < 0x20)
+        printf ("\\u%04x", *c);
+      else
+        putchar (*c);
+    }
+  putchar ('"');
+}
+
+static void
+print_result_start (const char *zimfile, const char *bench)
+{
+  printf ("{\"archive\":");
+  print_json_string (zimfile);
+  printf (",\"bench\":");
+  print_json_string (bench);
+}
+
+/*
+ * Run `argv`, with STDIN read from `input` if it's not NULL, and read its
+ * output. It's kept in `capture` if it's not NULL, which must then be
+ * freed. `bytes` is set to the size of the output and `seconds` to the
+ * time it took, start of the process included.
+ *
+ * Return non-zero in case of error, or if the command failed.
+ */
+static int
+run_command (char **argv, const char *input, char **capture, size_t *bytes, double *seconds)
+{
+  int err = 0;
+  int fds[2] = { -1, -1 };
+  posix_spawn_file_actions_t actions;
+  char *buf = NULL;
+  size_t capacity = 0;
+  pid_t pid = 0;
+  int status = 0;
+
+  *bytes = 0;
+  if (capture) *capture = NULL;
+
+  if (pipe (fds) == -1)
+    {
+      fprintf (stderr, "bench.c : run_command() : can't create pipe : %s\n", strerror (errno));
+      return 1;
+    }
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDIN_FILENO, input ? input : "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addclose (&actions, fds[0]);
+  posix_spawn_file_actions_addclose (&actions, fds[1]);
+
+  double start = now ();
+  err = posix_spawn (&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  close (fds[1]);
+
+  if (err)
+    {
+      fprintf (stderr, "bench.c : run_command() : can't start %s : %s\n", argv[0], strerror (err));
+      close (fds[0]);
+      return 1;
+    }
+
+  buf = xalloc (READ_BUFFER_SIZE);
+  capacity = READ_BUFFER_SIZE;
+
+  while (true)
+    {
+      size_t offset = capture ? *bytes : 0;
+      if (capture && capacity - offset < READ_BUFFER_SIZE)
+        {
+          capacity *= 2;
+          buf = xrealloc (buf, capacity);
+        }
+
+      ssize_t len = read (fds[0], buf + offset, READ_BUFFER_SIZE);
+      if (len == -1 && errno == EINTR)
+        continue;
+
+      if (len <= 0)
+        break;
+
+      *bytes += len;
+    }
+
+  close (fds[0]);
+  while (waitpid (pid, &status, 0) == -1 && errno == EINTR);
+  *seconds = now () - start;
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      err = 1;
+      fprintf (stderr, "bench.c : run_command() : %s failed.\n", argv[0]);
+    }
+
+  if (capture && !err)
+    {
+      buf = xrealloc (buf, *bytes + 1);
+      buf[*bytes] = 0;
+      *capture = buf;
+    }
+  else
+    free (buf);
+
+  return err;
+}
+
+/*
+ * Read the urls listed in `output`, in the text format of zim_dump.
+ */
+static void
+parse_url_list (char *output, url_list_t *urls)
+{
+  size_t capacity = 1024;
+  char *line = output;
+
+  urls->items = xalloc (capacity * sizeof (*urls->items));
+  urls->len = 0;
+
+  while (line && *line)
+    {
+      char *end = strchr (line, '\n');
+      if (end) *end = 0;
+
+      if (strncmp (line, "url: ", 5) == 0)
+        {
+          if (urls->len == capacity)
+            {
+              capacity *= 2;
+              urls->items = xrealloc (urls->items, capacity * sizeof (*urls->items));
+            }
+
+          urls->items[urls->len++] = strdup (line + 5);
+        }
+
+      line = end ? end + 1 : NULL;
+    }
+}
+
+static void
+free_url_list (url_list_t *urls)
+{
+  for (size_t i = 0; i < urls->len; i++)
+    free (urls->items[i]);
+
+  free (urls->items);
+}
+
+/*
+ * Run a full pass of zim_dump with `args` `options->runs` times, and print
+ * its median and fastest time.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+bench_full_pass (const char *zimfile, const char *name, const char **args, size_t entries, const bench_options_t *options)
+{
+  char *argv[MAX_ARGS] = { (char *) options->zim_dump };
+  double *times = xalloc (options->runs * sizeof (*times));
+  size_t bytes = 0;
+  size_t argc = 1;
+  int err = 0;
+
+  for (; args && args[argc - 1]; argc++)
+    argv[argc] = (char *) args[argc - 1];
+  argv[argc] = (char *) zimfile;
+
+  fprintf (stderr, "%s : %s\n", zimfile, name);
+
+  for (size_t run = 0; run < options->runs && !err; run++)
+    err = run_command (argv, NULL, NULL, &bytes, &times[run]);
+
+  if (!err)
+    {
+      qsort (times, options->runs, sizeof (*times), compare_doubles);
+      double median = times[options->runs / 2];
+
+      print_result_start (zimfile, name);
+      printf (",\"runs\":%zu,\"entries\":%zu,\"bytes\":%zu,\"seconds\":%.6f,\"min_seconds\":%.6f,\"entries_per_s\":%.1f,\"mb_per_s\":%.2f}\n",
+              options->runs, entries, bytes, median, times[0], entries / median, bytes / median / 1e6);
+    }
+
+  free (times);
+  return err;
+}
+
+static void
+print_latencies (const char *zimfile, const char *name, double *latencies, size_t len, double seconds)
+{
+  qsort (latencies, len, sizeof (*latencies), compare_doubles);
+
+  print_result_start (zimfile, name);
+  printf (",\"lookups\":%zu,\"seconds\":%.6f,\"entries_per_s\":%.1f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n",
+          len, seconds, len / seconds,
+          percentile (latencies, len, 50) * 1e3, percentile (latencies, len, 90) * 1e3,
+          percentile (latencies, len, 99) * 1e3, latencies[len - 1] * 1e3);
+}
+
+/*
+ * Look up random urls, each with a new zim_dump process.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+bench_cold_lookups (const char *zimfile, const url_list_t *urls, const bench_options_t *options)
+{
+  size_t count = options->cold_lookups;
+  double *latencies = xalloc (count * sizeof (*latencies));
+  uint64_t state = options->seed;
+  size_t bytes = 0;
+  int err = 0;
+
+  fprintf (stderr, "%s : lookup_cold\n", zimfile);
+
+  double start = now ();
+  for (size_t i = 0; i < count && !err; i++)
+    {
+      char *url = urls->items[next_random (&state) % urls->len];
+      char *argv[] = { (char *) options->zim_dump, (char *) zimfile, url, NULL };
+      err = run_command (argv, NULL, NULL, &bytes, &latencies[i]);
+    }
+
+  if (!err)
+    print_latencies (zimfile, "lookup_cold", latencies, count, now () - start);
+
+  free (latencies);
+  return err;
+}
+
+/*
+ * Write `url` in `dest` with characters other than letters, digits and
+ * `-._~/` percent-encoded. `dest` must hold 3 times the length of `url`.
+ */
+static void
+percent_encode (const char *url, char *dest)
+{
+  static const char hex[] = "0123456789ABCDEF";
+
+  for (const unsigned char *c = (const unsigned char *) url; *c; c++)
+    {
+      if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr ("-._~/", *c))
+        *dest++ = *c;
+      else
+        {
+          *dest++ = '%';
+          *dest++ = hex[*c >> 4];
+          *dest++ = hex[*c & 0x0F];
+        }
+    }
+
+  *dest = 0;
+}
+
+static int
+connect_to_server (const char *socket_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy (addr.sun_path, socket_path, sizeof (addr.sun_path) - 1);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/*
+ * Send one request for `url` of archive `name`, and read the answer.
+ *
+ * Return non-zero in case of error, or if the article wasn't found.
+ */
+static int
+request_url (const char *socket_path, const char *name, const char *url, char *buf)
+{
+  char *encoded = xalloc (3 * strlen (url) + 1);
+  int err = 0;
+  bool first = true;
+
+  percent_encode (url, encoded);
+
+  int fd = connect_to_server (socket_path);
+  if (fd == -1)
+    {
+      fprintf (stderr, "bench.c : request_url() : can't connect to server : %s\n", strerror (errno));
+      free (encoded);
+      return 1;
+    }
+
+  int len = snprintf (buf, READ_BUFFER_SIZE, "GET /%s/url/%s HTTP/1.0\r\n\r\n", name, encoded);
+  if (write (fd, buf, len) != len)
+    err = 1;
+
+  while (!err)
+    {
+      ssize_t got = read (fd, buf, READ_BUFFER_SIZE);
+      if (got == -1 && errno == EINTR)
+        continue;
+
+      if (got <= 0)
+        break;
+
+      if (first && (got < 12 || strncmp (buf + 9, "200", 3) != 0))
+        err = 1;
+
+      first = false;
+    }
+
+  if (err || first)
+    {
+      err = 1;
+      fprintf (stderr, "bench.c : request_url() : request failed for %s\n", url);
+    }
+
+  close (fd);
+  free (encoded);
+  return err;
+}
+
+/*
+ * Look up random urls on a single `zim_dump --serve` instance, which keeps
+ * the archive open and its clusters cached between requests.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+bench_warm_lookups (const char *zimfile, const url_list_t *urls, const bench_options_t *options)
+{
+  size_t count = options->warm_lookups;
+  double *latencies = xalloc (count * sizeof (*latencies));
+  char *buf = xalloc (READ_BUFFER_SIZE);
+  uint64_t state = options->seed;
+  char socket_path[64];
+  char serve[80];
+  char *name = NULL;
+  pid_t pid = 0;
+  int err = 0;
+
+  fprintf (stderr, "%s : lookup_warm\n", zimfile);
+
+  snprintf (socket_path, sizeof (socket_path), "/tmp/zim_bench_%d.sock", (int) getpid ());
+  snprintf (serve, sizeof (serve), "--serve=%s", socket_path);
+
+  const char *slash = strrchr (zimfile, '/');
+  name = strdup (slash ? slash + 1 : zimfile);
+  size_t name_len = strlen (name);
+  if (name_len > 4 && strcmp (name + name_len - 4, ".zim") == 0)
+    name[name_len - 4] = 0;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+  char *argv[] = { (char *) options->zim_dump, serve, (char *) zimfile, NULL };
+  err = posix_spawn (&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  if (err)
+    {
+      fprintf (stderr, "bench.c : bench_warm_lookups() : can't start %s : %s\n", argv[0], strerror (err));
+      pid = 0;
+      goto cleanup;
+    }
+
+  int fd = -1;
+  for (int waited = 0; fd == -1 && waited < SERVER_START_TIMEOUT_MS; waited += 10)
+    {
+      fd = connect_to_server (socket_path);
+      if (fd == -1)
+        usleep (10 * 1000);
+    }
+
+  if (fd == -1)
+    {
+      err = 1;
+      fprintf (stderr, "bench.c : bench_warm_lookups() : server didn't start.\n");
+      goto cleanup;
+    }
+
+  close (fd);
+
+  double start = now ();
+  for (size_t i = 0; i < count && !err; i++)
+    {
+      char *url = urls->items[next_random (&state) % urls->len];
+      double request_start = now ();
+      err = request_url (socket_path, name, url, buf);
+      latencies[i] = now () - request_start;
+    }
+
+  if (!err)
+    print_latencies (zimfile, "lookup_warm", latencies, count, now () - start);
+
+  cleanup:
+  if (pid)
+    {
+      kill (pid, SIGTERM);
+      while (waitpid (pid, NULL, 0) == -1 && errno == EINTR);
+    }
+
+  unlink (socket_path);
+  free (name);
+  free (buf);
+  free (latencies);
+  return err;
+}
+
+/*
+ * Look up random urls with a single `zim_dump --batch` run.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+bench_batch (const char *zimfile, const url_list_t *urls, const bench_options_t *options)
+{
+  char input[] = "/tmp/zim_bench_XXXXXX";
+  uint64_t state = options->seed;
+  size_t bytes = 0;
+  double seconds = 0;
+  int err = 0;
+
+  fprintf (stderr, "%s : batch\n", zimfile);
+
+  int fd = mkstemp (input);
+  if (fd == -1)
+    {
+      fprintf (stderr, "bench.c : bench_batch() : can't create temporary file : %s\n", strerror (errno));
+      return 1;
+    }
+
+  FILE *list = fdopen (fd, "w");
+  for (size_t i = 0; i < options->batch_lookups; i++)
+    fprintf (list, "%s\n", urls->items[next_random (&state) % urls->len]);
+
+  if (fclose (list))
+    {
+      err = 1;
+      fprintf (stderr, "bench.c : bench_batch() : can't write %s.\n", input);
+      goto cleanup;
+    }
+
+  char *argv[] = { (char *) options->zim_dump, "--batch", (char *) zimfile, NULL };
+  err = run_command (argv, input, NULL, &bytes, &seconds);
+  if (err)
+    goto cleanup;
+
+  print_result_start (zimfile, "batch");
+  printf (",\"lookups\":%zu,\"bytes\":%zu,\"seconds\":%.6f,\"entries_per_s\":%.1f,\"mb_per_s\":%.2f}\n",
+          options->batch_lookups, bytes, seconds, options->batch_lookups / seconds, bytes / seconds / 1e6);
+
+  cleanup:
+  unlink (input);
+  return err;
+}
+
+/*
+ * Run all benchmarks on `zimfile`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+bench_archive (const char *zimfile, const bench_options_t *options)
+{
+  char jobs[24];
+  char *output = NULL;
+  url_list_t urls = { 0 };
+  size_t bytes = 0;
+  double seconds = 0;
+  int err = 0;
+
+  char *argv[] = { (char *) options->zim_dump, (char *) zimfile, NULL };
+  err = run_command (argv, NULL, &output, &bytes, &seconds);
+  if (err)
+    return 1;
+
+  parse_url_list (output, &urls);
+  free (output);
+
+  if (urls.len == 0)
+    {
+      fprintf (stderr, "bench.c : bench_archive() : no article in %s.\n", zimfile);
+      free_url_list (&urls);
+      return 1;
+    }
+
+  snprintf (jobs, sizeof (jobs), "%zu", options->jobs);
+
+  const char *dump[] = { "-a", NULL };
+  const char *dump_cluster_order[] = { "-a", "-c", NULL };
+  const char *dump_parallel[] = { "-a", "-j", jobs, NULL };
+
+  err = bench_full_pass (zimfile, "list", NULL, urls.len, options)
+    || bench_full_pass (zimfile, "dump", dump, urls.len, options)
+    || bench_full_pass (zimfile, "dump_cluster_order", dump_cluster_order, urls.len, options)
+    || bench_full_pass (zimfile, "dump_parallel", dump_parallel, urls.len, options)
+    || (options->cold_lookups && bench_cold_lookups (zimfile, &urls, options))
+    || (options->warm_lookups && bench_warm_lookups (zimfile, &urls, options))
+    || (options->batch_lookups && bench_batch (zimfile, &urls, options));
+
+  fflush (stdout);
+  free_url_list (&urls);
+  return err;
+}
+
+static int
+parse_count (const char *str, size_t *count)
+{
+  char *end = NULL;
+  unsigned long long int value = strtoull (str, &end, 10);
+  if (end == str || *end)
+    return 1;
+
+  *count = value;
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  bench_options_t options = {
+    .zim_dump = "./zim_dump",
+    .runs = 3,
+    .jobs = 4,
+    .cold_lookups = 100,
+    .warm_lookups = 1000,
+    .batch_lookups = 10000,
+    .seed = 1,
+  };
+  size_t value = 0;
+  int opt = 0;
+  int err = 0;
+
+  while ((opt = getopt (argc, argv, "hz:r:j:n:w:b:S:")) != -1)
+    {
+      switch (opt)
+        {
+          case 'h':
+            usage (argv[0]);
+            exit (0);
+
+          case 'z':
+            options.zim_dump = optarg;
+            break;
+
+          case 'r':
+            if (parse_count (optarg, &options.runs) || options.runs == 0)
+              {
+                fprintf (stderr, "Invalid runs count : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'j':
+            if (parse_count (optarg, &options.jobs) || options.jobs == 0)
+              {
+                fprintf (stderr, "Invalid jobs count : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'n':
+          case 'w':
+          case 'b':
+            if (parse_count (optarg, &value))
+              {
+                fprintf (stderr, "Invalid lookups count : %s\n", optarg);
+                exit (1);
+              }
+
+            if (opt == 'n')
+              options.cold_lookups = value;
+            else if (opt == 'w')
+              options.warm_lookups = value;
+            else
+              options.batch_lookups = value;
+            break;
+
+          case 'S':
+            if (parse_count (optarg, &value))
+              {
+                fprintf (stderr, "Invalid seed : %s\n", optarg);
+                exit (1);
+              }
+            options.seed = value;
+            break;
+
+          default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+  if (optind == argc)
+    {
+      usage (argv[0]);
+      exit (1);
+    }
+
+  signal (SIGPIPE, SIG_IGN);
+
+  for (int i = optind; i < argc; i++)
+    if (bench_archive (argv[i], &options))
+      err = 1;
+
+  return err;
+}
@@ -0,0 +1,676 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <lzma.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+#include "utils.h"
+
+#define ZIM_MAGIC_NUMBER 72173914
+#define ZIM_HEADER_SIZE 80
+#define MIME_TYPE_REDIRECT 0xffff
+#define COMPRESSION_NONE 1
+#define COMPRESSION_XZ 4
+#define COMPRESSION_ZSTD 5
+#define MAX_CLUSTER_SIZE (1024 * 1024 * 1024)
+
+static const char *MIME_TYPES[] = {
+  "text/html",
+  "image/png",
+  "text/plain",
+  "text/css",
+  "image/jpeg",
+  "application/javascript",
+  "image/svg+xml",
+  "application/pdf",
+};
+
+#define MIME_TYPES_COUNT (sizeof (MIME_TYPES) / sizeof (*MIME_TYPES))
+
+static const char *WORDS[] = {
+  "the", "of", "and", "in", "to", "was", "is", "for", "on", "as", "with",
+  "by", "he", "at", "from", "his", "an", "were", "are", "which", "this",
+  "also", "be", "has", "or", "had", "first", "one", "their", "its", "after",
+  "new", "who", "they", "two", "her", "she", "been", "other", "when", "time",
+  "during", "there", "into", "school", "more", "may", "years", "over",
+  "only", "year", "most", "would", "world", "city", "some", "where", "between",
+  "later", "three", "state", "such", "then", "national", "used", "made",
+  "known", "under", "many", "university", "united", "while", "part", "season",
+  "team", "these", "american", "than", "film", "second", "born", "south",
+  "became", "states", "war", "through", "being", "including", "both", "before",
+};
+
+#define WORDS_COUNT (sizeof (WORDS) / sizeof (*WORDS))
+
+typedef struct {
+  size_t entries;
+  unsigned int redirect_percent;
+  size_t mime_types;
+  size_t cluster_size;
+  size_t article_size;
+  int compression;
+  int level;
+  uint64_t seed;
+  bool invalid_utf8;
+} zimgen_options_t;
+
+/*
+ * One entry of the generated archive, in url order.
+ */
+typedef struct {
+  char namespace;
+  unsigned short mime_type;
+  char *url;
+  char *title;
+  size_t id;
+  size_t size;
+  size_t redirect_index;
+  size_t cluster;
+  size_t blob;
+  uint64_t dirent_pos;
+} zimgen_entry_t;
+
+typedef struct {
+  bool compressed;
+  size_t raw_size;
+  size_t blobs_count;
+  size_t first_blob;
+} zimgen_cluster_t;
+
+typedef struct {
+  zimgen_entry_t *entries;
+  size_t entries_count;
+  zimgen_cluster_t *clusters;
+  size_t clusters_count;
+  size_t *cluster_blobs;
+} zimgen_archive_t;
+
+static void
+usage (const char *progname)
+{
+  printf (
+    "%s [-n <entries>] [-r <redirect percent>] [-m <mime-types>] [-s <cluster size>]\n"
+    "    [-b <article size>] [-c none|xz|zstd] [-l <level>] [-S <seed>] [-x] <zimfile>\n"
+    "\n"
+    "Write a synthetic zimfile, for benchmarks.\n"
+    "\n"
+    "<entries> entries are created (default: 20000), <redirect percent> of them\n"
+    "being redirects to random articles (default: 10). Articles use the first\n"
+    "<mime-types> of a list of 8 common ones (default: 4) : images are stored\n"
+    "in namespace I, in uncompressed clusters, like real archives do, and\n"
+    "everything else in namespace A.\n"
+    "\n"
+    "Text articles are made of english words, which compress like real text.\n"
+    "They are <article size> bytes on average (default: 4K), and grouped in\n"
+    "clusters of about <cluster size> bytes (default: 1M), compressed with\n"
+    "<level> (default: 6 for xz, 3 for zstd). Sizes accept a K, M or G suffix.\n"
+    "\n"
+    "With -x, about one word of text articles in 16 is replaced by an accented\n"
+    "one in UTF-8, or by bytes which aren't valid UTF-8 : latin-1, a truncated\n"
+    "sequence, a surrogate or a code point above U+10FFFF. That checks output\n"
+    "stays valid when an archive isn't.\n"
+    "\n"
+    "The same options and <seed> (default: 1) always give the same file. Its\n"
+    "MD5 checksum is left zeroed.\n",
+  progname);
+}
+
+/*
+ * splitmix64, so output doesn't depend on the libc.
+ */
+static uint64_t
+next_random (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static bool
+is_image (unsigned short mime_type)
+{
+  return strncmp (MIME_TYPES[mime_type], "image/", 6) == 0 && strcmp (MIME_TYPES[mime_type], "image/svg+xml") != 0;
+}
+
+static char *
+format_string (const char *format, size_t value)
+{
+  int len = snprintf (NULL, 0, format, value);
+  char *str = xalloc (len + 1);
+  snprintf (str, len + 1, format, value);
+  return str;
+}
+
+static int
+compare_titles (const void *a, const void *b, void *data)
+{
+  const zimgen_entry_t *entries = data;
+  const zimgen_entry_t *first = &entries[*(const uint32_t *) a];
+  const zimgen_entry_t *second = &entries[*(const uint32_t *) b];
+
+  if (first->namespace != second->namespace)
+    return first->namespace < second->namespace ? -1 : 1;
+
+  return strcmp (first->title, second->title);
+}
+
+/*
+ * Decide what each entry is, then where articles are stored. Entries of
+ * namespace A come first, their urls being zero padded so creation order
+ * is url order.
+ */
+static void
+plan_archive (zimgen_archive_t *archive, const zimgen_options_t *options)
+{
+  uint64_t state = options->seed;
+  size_t count = options->entries;
+  unsigned short *mime_types = xalloc (count * sizeof (*mime_types));
+  size_t *contents = xalloc (count * sizeof (*contents));
+  size_t contents_count = 0;
+
+  archive->entries = xalloc (count * sizeof (*archive->entries));
+  archive->entries_count = count;
+
+  for (size_t id = 0; id < count; id++)
+    {
+      mime_types[id] = next_random (&state) % options->mime_types;
+      if (id > 0 && next_random (&state) % 100 < options->redirect_percent)
+        mime_types[id] = MIME_TYPE_REDIRECT;
+    }
+
+  size_t i = 0;
+  for (int pass = 0; pass < 2; pass++)
+    for (size_t id = 0; id < count; id++)
+      {
+        bool image = mime_types[id] != MIME_TYPE_REDIRECT && is_image (mime_types[id]);
+        if (image != (pass == 1))
+          continue;
+
+        zimgen_entry_t *entry = &archive->entries[i];
+        entry->namespace = image ? 'I' : 'A';
+        entry->mime_type = mime_types[id];
+        entry->id = id;
+        entry->url = format_string (image ? "image_%08zu" : "article_%08zu", id);
+        entry->title = format_string (image ? "Image %zu" : "Article %zu", id);
+
+        if (entry->mime_type != MIME_TYPE_REDIRECT)
+          {
+            entry->size = options->article_size / 2 + next_random (&state) % (options->article_size + 1);
+            contents[contents_count++] = i;
+          }
+
+        i++;
+      }
+
+  // clusters are filled in url order, one for compressible content and
+  // one for images at a time
+  size_t open_clusters[2] = { SIZE_MAX, SIZE_MAX };
+  archive->clusters = xalloc ((contents_count + 1) * sizeof (*archive->clusters));
+
+  for (size_t c = 0; c < contents_count; c++)
+    {
+      zimgen_entry_t *entry = &archive->entries[contents[c]];
+      bool compressed = !is_image (entry->mime_type);
+      size_t *open = &open_clusters[compressed];
+
+      if (*open == SIZE_MAX || archive->clusters[*open].raw_size >= options->cluster_size)
+        {
+          *open = archive->clusters_count++;
+          archive->clusters[*open].compressed = compressed;
+        }
+
+      zimgen_cluster_t *cluster = &archive->clusters[*open];
+      entry->cluster = *open;
+      entry->blob = cluster->blobs_count++;
+      cluster->raw_size += entry->size;
+    }
+
+  archive->cluster_blobs = xalloc ((contents_count + 1) * sizeof (*archive->cluster_blobs));
+  for (size_t c = 0, first = 0; c < archive->clusters_count; c++)
+    {
+      archive->clusters[c].first_blob = first;
+      first += archive->clusters[c].blobs_count;
+    }
+
+  for (size_t c = 0; c < contents_count; c++)
+    {
+      const zimgen_entry_t *entry = &archive->entries[contents[c]];
+      archive->cluster_blobs[archive->clusters[entry->cluster].first_blob + entry->blob] = contents[c];
+    }
+
+  for (size_t e = 0; e < count; e++)
+    if (archive->entries[e].mime_type == MIME_TYPE_REDIRECT)
+      archive->entries[e].redirect_index = contents[next_random (&state) % contents_count];
+
+  free (mime_types);
+  free (contents);
+}
+
+/*
+ * Write the content of `entry` in `dest`. It only depends on the seed and
+ * the entry, so clusters can be written in any order.
+ */
+static void
+generate_content (const zimgen_entry_t *entry, const zimgen_options_t *options, char *dest)
+{
+  uint64_t state = options->seed ^ (entry->id * 0xD6E8FEB86659FD93ULL);
+  size_t len = 0;
+
+  if (is_image (entry->mime_type))
+    {
+      while (len < entry->size)
+        {
+          uint64_t bytes = next_random (&state);
+          size_t chunk = entry->size - len < 8 ? entry->size - len : 8;
+          memcpy (dest + len, &bytes, chunk);
+          len += chunk;
+        }
+
+      return;
+    }
+
+  char head[256];
+  int written = snprintf (head, sizeof (head), "<html><head><title>%s</title></head><body><p>", entry->title);
+  len = (size_t) written < entry->size ? (size_t) written : entry->size;
+  memcpy (dest, head, len);
+
+  while (len < entry->size)
+    {
+      uint64_t random = next_random (&state);
+      const char *word = WORDS[random % WORDS_COUNT];
+      const char *separator = random >> 60 == 0 ? ".</p>\n<p>" : " ";
+
+      if (options->invalid_utf8 && (random >> 52 & 0x0F) == 0)
+        {
+          static const char *odd_words[] = { "caf\xc3\xa9", "caf\xe9", "euro\xe2\x82", "\xed\xa0\x80", "\xf4\x90\x80\x80" };
+          word = odd_words[(random >> 48 & 0x0F) % (sizeof (odd_words) / sizeof (*odd_words))];
+        }
+
+      for (const char *c = word; *c && len < entry->size; c++)
+        dest[len++] = *c;
+
+      for (const char *c = separator; *c && len < entry->size; c++)
+        dest[len++] = *c;
+    }
+}
+
+/*
+ * Build the raw cluster `c`, offsets then blobs, and compress it into
+ * `dest` after the info byte.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+build_cluster (const zimgen_archive_t *archive, const zimgen_options_t *options, size_t c, char **dest, size_t *dest_len)
+{
+  const zimgen_cluster_t *cluster = &archive->clusters[c];
+  size_t offsets_size = 4 * (cluster->blobs_count + 1);
+  size_t raw_len = offsets_size + cluster->raw_size;
+  char *raw = xalloc (raw_len);
+  uint32_t offset = offsets_size;
+  int err = 0;
+
+  for (size_t b = 0; b < cluster->blobs_count; b++)
+    {
+      const zimgen_entry_t *entry = &archive->entries[archive->cluster_blobs[cluster->first_blob + b]];
+      memcpy (raw + 4 * b, &offset, 4);
+      generate_content (entry, options, raw + offset);
+      offset += entry->size;
+    }
+
+  memcpy (raw + 4 * cluster->blobs_count, &offset, 4);
+
+  int compression = cluster->compressed ? options->compression : COMPRESSION_NONE;
+  size_t bound = raw_len;
+  if (compression == COMPRESSION_XZ)
+    bound = lzma_stream_buffer_bound (raw_len);
+  else if (compression == COMPRESSION_ZSTD)
+    bound = ZSTD_compressBound (raw_len);
+
+  *dest = xrealloc (*dest, bound + 1);
+  (*dest)[0] = compression;
+  *dest_len = 0;
+
+  if (compression == COMPRESSION_XZ)
+    {
+      if (lzma_easy_buffer_encode (options->level, LZMA_CHECK_CRC64, NULL, (uint8_t *) raw, raw_len, (uint8_t *) *dest + 1, dest_len, bound) != LZMA_OK)
+        {
+          err = 1;
+          fprintf (stderr, "zimgen.c : build_cluster() : xz compression failed.\n");
+        }
+    }
+  else if (compression == COMPRESSION_ZSTD)
+    {
+      *dest_len = ZSTD_compress (*dest + 1, bound, raw, raw_len, options->level);
+      if (ZSTD_isError (*dest_len))
+        {
+          err = 1;
+          fprintf (stderr, "zimgen.c : build_cluster() : zstd compression failed : %s\n", ZSTD_getErrorName (*dest_len));
+        }
+    }
+  else
+    {
+      memcpy (*dest + 1, raw, raw_len);
+      *dest_len = raw_len;
+    }
+
+  *dest_len += 1;
+  free (raw);
+  return err;
+}
+
+static void
+write_u16 (FILE *file, uint16_t value)
+{
+  fwrite (&value, 2, 1, file);
+}
+
+static void
+write_u32 (FILE *file, uint32_t value)
+{
+  fwrite (&value, 4, 1, file);
+}
+
+static void
+write_u64 (FILE *file, uint64_t value)
+{
+  fwrite (&value, 8, 1, file);
+}
+
+/*
+ * Write `archive` at `path`.
+ *
+ * Parts are in the usual order : header, mime-type list, url and title
+ * pointer lists, directory entries, cluster pointer list, clusters and
+ * checksum. Cluster pointers are only known once clusters are
+ * compressed, so they're written last, along with the header.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+write_archive (zimgen_archive_t *archive, const zimgen_options_t *options, const char *path)
+{
+  int err = 0;
+  FILE *file = NULL;
+  uint32_t *title_order = NULL;
+  uint64_t *cluster_ptrs = NULL;
+  char *cluster = NULL;
+  size_t cluster_len = 0;
+  size_t count = archive->entries_count;
+
+  file = fopen (path, "wb");
+  if (!file)
+    {
+      err = 1;
+      fprintf (stderr, "zimgen.c : write_archive() : can't open %s for writing.\n", path);
+      goto cleanup;
+    }
+
+  uint64_t pos = ZIM_HEADER_SIZE;
+  uint64_t mime_list_pos = pos;
+  for (size_t m = 0; m < options->mime_types; m++)
+    pos += strlen (MIME_TYPES[m]) + 1;
+  pos += 1;
+
+  uint64_t url_ptr_pos = pos;
+  pos += 8 * count;
+  uint64_t title_ptr_pos = pos;
+  pos += 4 * count;
+
+  for (size_t e = 0; e < count; e++)
+    {
+      zimgen_entry_t *entry = &archive->entries[e];
+      entry->dirent_pos = pos;
+      pos += (entry->mime_type == MIME_TYPE_REDIRECT ? 12 : 16) + strlen (entry->url) + strlen (entry->title) + 2;
+    }
+
+  uint64_t cluster_ptr_pos = pos;
+
+  fseeko (file, mime_list_pos, SEEK_SET);
+  for (size_t m = 0; m < options->mime_types; m++)
+    fwrite (MIME_TYPES[m], strlen (MIME_TYPES[m]) + 1, 1, file);
+  fputc (0, file);
+
+  for (size_t e = 0; e < count; e++)
+    write_u64 (file, archive->entries[e].dirent_pos);
+
+  title_order = xalloc ((count + 1) * sizeof (*title_order));
+  for (size_t e = 0; e < count; e++)
+    title_order[e] = e;
+
+  qsort_r (title_order, count, sizeof (*title_order), compare_titles, archive->entries);
+  fwrite (title_order, sizeof (*title_order), count, file);
+
+  for (size_t e = 0; e < count; e++)
+    {
+      const zimgen_entry_t *entry = &archive->entries[e];
+      write_u16 (file, entry->mime_type);
+      fputc (0, file);
+      fputc (entry->namespace, file);
+      write_u32 (file, 0);
+
+      if (entry->mime_type == MIME_TYPE_REDIRECT)
+        write_u32 (file, entry->redirect_index);
+      else
+        {
+          write_u32 (file, entry->cluster);
+          write_u32 (file, entry->blob);
+        }
+
+      fwrite (entry->url, strlen (entry->url) + 1, 1, file);
+      fwrite (entry->title, strlen (entry->title) + 1, 1, file);
+    }
+
+  cluster_ptrs = xalloc ((archive->clusters_count + 1) * sizeof (*cluster_ptrs));
+  pos = cluster_ptr_pos + 8 * archive->clusters_count;
+  fseeko (file, pos, SEEK_SET);
+
+  for (size_t c = 0; c < archive->clusters_count; c++)
+    {
+      err = build_cluster (archive, options, c, &cluster, &cluster_len);
+      if (err)
+        goto cleanup;
+
+      cluster_ptrs[c] = pos;
+      fwrite (cluster, cluster_len, 1, file);
+      pos += cluster_len;
+    }
+
+  uint64_t checksum_pos = pos;
+  char checksum[16] = { 0 };
+  fwrite (checksum, sizeof (checksum), 1, file);
+
+  fseeko (file, cluster_ptr_pos, SEEK_SET);
+  fwrite (cluster_ptrs, sizeof (*cluster_ptrs), archive->clusters_count, file);
+
+  char uuid[16] = { 0 };
+  memcpy (uuid, &options->seed, sizeof (options->seed));
+
+  fseeko (file, 0, SEEK_SET);
+  write_u32 (file, ZIM_MAGIC_NUMBER);
+  write_u16 (file, 5);
+  write_u16 (file, 0);
+  fwrite (uuid, sizeof (uuid), 1, file);
+  write_u32 (file, count);
+  write_u32 (file, archive->clusters_count);
+  write_u64 (file, url_ptr_pos);
+  write_u64 (file, title_ptr_pos);
+  write_u64 (file, cluster_ptr_pos);
+  write_u64 (file, mime_list_pos);
+  write_u32 (file, 0xffffffff);
+  write_u32 (file, 0xffffffff);
+  write_u64 (file, checksum_pos);
+
+  if (ferror (file))
+    {
+      err = 1;
+      fprintf (stderr, "zimgen.c : write_archive() : can't write %s.\n", path);
+    }
+
+  cleanup:
+  if (file && fclose (file)) err = 1;
+  if (title_order) free (title_order);
+  if (cluster_ptrs) free (cluster_ptrs);
+  if (cluster) free (cluster);
+  return err;
+}
+
+static void
+free_archive (zimgen_archive_t *archive)
+{
+  for (size_t e = 0; e < archive->entries_count; e++)
+    {
+      free (archive->entries[e].url);
+      free (archive->entries[e].title);
+    }
+
+  free (archive->entries);
+  free (archive->clusters);
+  free (archive->cluster_blobs);
+}
+
+static int
+parse_count (const char *str, size_t *count)
+{
+  char *end = NULL;
+  unsigned long long int value = strtoull (str, &end, 10);
+  if (end == str || *end)
+    return 1;
+
+  *count = value;
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  zimgen_options_t options = {
+    .entries = 20000,
+    .redirect_percent = 10,
+    .mime_types = 4,
+    .cluster_size = 1024 * 1024,
+    .article_size = 4 * 1024,
+    .compression = COMPRESSION_ZSTD,
+    .level = -1,
+    .seed = 1,
+  };
+  size_t value = 0;
+  int opt = 0;
+
+  while ((opt = getopt (argc, argv, "hn:r:m:s:b:c:l:S:x")) != -1)
+    {
+      switch (opt)
+        {
+          case 'h':
+            usage (argv[0]);
+            exit (0);
+
+          case 'n':
+            if (parse_count (optarg, &options.entries) || options.entries == 0 || options.entries > UINT32_MAX)
+              {
+                fprintf (stderr, "Invalid entries count : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'r':
+            if (parse_count (optarg, &value) || value > 100)
+              {
+                fprintf (stderr, "Invalid redirect percent : %s\n", optarg);
+                exit (1);
+              }
+            options.redirect_percent = value;
+            break;
+
+          case 'm':
+            if (parse_count (optarg, &options.mime_types) || options.mime_types == 0 || options.mime_types > MIME_TYPES_COUNT)
+              {
+                fprintf (stderr, "Invalid mime-types count, it must be between 1 and %zu : %s\n", MIME_TYPES_COUNT, optarg);
+                exit (1);
+              }
+            break;
+
+          case 's':
+            if (parse_size (optarg, &options.cluster_size) || options.cluster_size > MAX_CLUSTER_SIZE)
+              {
+                fprintf (stderr, "Invalid cluster size : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'b':
+            if (parse_size (optarg, &options.article_size) || options.article_size > MAX_CLUSTER_SIZE)
+              {
+                fprintf (stderr, "Invalid article size : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'c':
+            if (strcmp (optarg, "none") == 0)
+              options.compression = COMPRESSION_NONE;
+            else if (strcmp (optarg, "xz") == 0)
+              options.compression = COMPRESSION_XZ;
+            else if (strcmp (optarg, "zstd") == 0)
+              options.compression = COMPRESSION_ZSTD;
+            else
+              {
+                fprintf (stderr, "Invalid compression, it must be none, xz or zstd : %s\n", optarg);
+                exit (1);
+              }
+            break;
+
+          case 'l':
+            if (parse_count (optarg, &value) || value > 22)
+              {
+                fprintf (stderr, "Invalid compression level : %s\n", optarg);
+                exit (1);
+              }
+            options.level = value;
+            break;
+
+          case 'S':
+            if (parse_count (optarg, &value))
+              {
+                fprintf (stderr, "Invalid seed : %s\n", optarg);
+                exit (1);
+              }
+            options.seed = value;
+            break;
+
+          case 'x':
+            options.invalid_utf8 = true;
+            break;
+
+          default:
+            usage (argv[0]);
+            exit (1);
+        }
+    }
+
+  if (optind != argc - 1)
+    {
+      usage (argv[0]);
+      exit (1);
+    }
+
+  if (options.level == -1)
+    options.level = options.compression == COMPRESSION_XZ ? 6 : 3;
+  else if (options.compression == COMPRESSION_XZ && options.level > 9)
+    {
+      fprintf (stderr, "Invalid compression level for xz, it must be between 0 and 9.\n");
+      exit (1);
+    }
+
+  zimgen_archive_t archive = { 0 };
+  plan_archive (&archive, &options);
+  int err = write_archive (&archive, &options, argv[optind]);
+  free_archive (&archive);
+
+  return err;
+}
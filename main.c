@@ -1,9 +1,14 @@
+#include <errno.h>
+#include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "server.h"
+#include "stats.h"
 #include "utils.h"
 #include "zim.h"
 
@@ -11,7 +16,12 @@ static void
 usage (const char *progname)
 {
   printf (
-    "%s [-h|--help] [-m] [-a [-t <whitelisted mime-types>]] <zimfile> [url]\n" 
+    "%s [-h|--help] [-m] [-a [-t <whitelisted mime-types>] [-c [-o <window>]] [-j <jobs>]]\n"
+    "    [--title-order | --prefix=<prefix>] [--cluster-cache=<size>] [-T <title>]\n"
+    "    [--mime=<mime-types>] [--namespace=<namespaces>] [--min-size=<size>] [--max-size=<size>]\n"
+    "    [--range=<start>:<end>] [--shard=<i>/<n>] [--checkpoint=<file> [--resume]]\n"
+    "    [--batch[=url|index]] [--format=text|binary|jsonl] [--stats] <zimfile> [url]\n"
+    "%s [-j <jobs>] [--cluster-cache=<size>] --serve=<port|socket> <zimfile>...\n" 
     "\n" 
     "Parse a zimfile and print articles' urls and names on STDOUT.\n" 
     "\n"
@@ -21,27 +31,226 @@ usage (const char *progname)
     "whitelisted mime-types with the `-t` option. If the mime-type of the\n"
     "article is not in the list, it will only print `NOT-WHITELISTED-MIME-TYPE`.\n"
     "\n"
+    "If `-c` is provided along with `-a`, articles with content are printed in the\n"
+    "order of the clusters they are stored in, so each cluster is decompressed\n"
+    "only once. Articles without content are printed first, in url order.\n"
+    "Add `-o <window>` to keep url order instead, by reordering articles\n"
+    "by windows of <window> articles.\n"
+    "\n"
+    "If `--title-order` is provided, articles are listed in title order rather\n"
+    "than url order. It can't be used with `-c`.\n"
+    "\n"
+    "If `--prefix=<prefix>` is provided, only articles whose url starts with\n"
+    "<prefix> are listed. <prefix> starts with the namespace : `A/Foo` selects\n"
+    "urls starting with `Foo` in namespace A, and `A` the whole namespace A.\n"
+    "It can't be used with `--title-order`.\n"
+    "\n"
+    "If `--mime=<mime-types>` is provided, only articles whose mime-type starts\n"
+    "with one in that comma separated list are listed, and with\n"
+    "`--namespace=<namespaces>`, only articles in one of those namespaces, like\n"
+    "`--namespace=AI`. `--min-size=<size>` and `--max-size=<size>` only list\n"
+    "articles whose content has at least or at most that size, with an optional\n"
+    "K, M or G suffix. Redirects and deleted pages have no mime-type nor\n"
+    "content, so they're left out by those options. Sizes are read without\n"
+    "decompressing content.\n"
+    "\n"
+    "If `--range=<start>:<end>` is provided, only articles at positions <start>\n"
+    "to <end> (excluded) in the url list are listed. Either bound can be omitted.\n"
+    "\n"
+    "If `--shard=<i>/<n>` is provided, articles are split in <n> shards and only\n"
+    "shard <i> is listed, counting from 0. Shards take about the same work to\n"
+    "read and decompress the clusters of the selected articles, and each cluster\n"
+    "belongs to a single shard, so running all of them on different machines\n"
+    "decompresses every cluster once.\n"
+    "\n"
+    "If `--checkpoint=<file>` is provided, progress is saved in <file> every 10\n"
+    "seconds. Run the same command with `--resume` to continue from there after\n"
+    "an interruption. When STDOUT is a regular file, append to it with `>>` :\n"
+    "it's cut back to where the checkpoint was made, so no article is repeated\n"
+    "or truncated.\n"
+    "\n"
+    "If `-j <jobs>` is provided along with `-a`, <jobs> threads are used to\n"
+    "decompress content, at most 1024. Output order stays the same.\n"
+    "\n"
+    "Decompressed clusters are kept in memory, so articles stored in the same\n"
+    "cluster don't need to decompress it again. `--cluster-cache=<size>` sets\n"
+    "the maximum memory used for that, with an optional K, M or G suffix\n"
+    "(default: 64M).\n"
+    "\n"
+    "`--format=binary` prints articles as length-prefixed binary records instead\n"
+    "of text, see README.md. `--format=jsonl` prints one JSON object per line,\n"
+    "with url, title, mime, index and content.\n"
+    "\n"
+    "If `--stats` is provided, print progress on STDERR every 10 seconds, and\n"
+    "a summary when done : time spent parsing directory entries, reading and\n"
+    "decompressing clusters and writing output, bytes read, decompressed and\n"
+    "written, cluster cache hits, redirects followed and peak memory.\n"
+    "\n"
     "If `-m` is provided, print instead the list of mime-types in the archive,\n" 
     "ignoring other options.\n"
     "\n"
     "If `url` is provided, print instead the content of the article corresponding to the\n"
     "provided url. Those urls are the ones provided while listing all articles.\n"
-    "In that case, options are ignored.\n",
-  progname);
+    "In that case, options are ignored. Content is written as it's decompressed,\n"
+    "so articles of any size only need a little memory.\n"
+    "\n"
+    "If `-T <title>` is provided, print instead the content of the article with\n"
+    "that title.\n"
+    "\n"
+    "If `--batch` is provided, read urls from STDIN, one per line, and print\n"
+    "those articles as with `-a`, in the same order. With `--batch=index`, lines\n"
+    "are positions in the url list instead. Redirects are followed. Lookups are\n"
+    "grouped by windows of 4096 lines, or <window> with `-o`, so each cluster\n"
+    "they need is decompressed once.\n"
+    "\n"
+    "If `--serve` is provided, keep all given zimfiles open and serve their\n"
+    "articles over HTTP, on localhost if <port|socket> is a port number, or on\n"
+    "a unix socket at that path otherwise. <jobs> threads answer requests\n"
+    "(default: 4), until interrupted. Archives are named after their file,\n"
+    "without `.zim`:\n"
+    "\n"
+    "    GET /                          list of archives\n"
+    "    GET /<archive>/url/<url>       content of the article at <url>\n"
+    "    GET /<archive>/index/<n>       content of the article at position <n>\n"
+    "    GET /<archive>/list            list of articles\n"
+    "    GET /<archive>/list?prefix=<p> articles whose url starts with <p>,\n"
+    "                                   as with `--prefix`\n",
+  progname, progname);
 }
 
 enum {
   MODE_ALL,
   MODE_SINGLE,
   MODE_MIME,
+  MODE_TITLE,
+  MODE_BATCH,
+  MODE_SERVE,
+};
+
+enum {
+  OPT_CLUSTER_CACHE = 256,
+  OPT_TITLE_ORDER,
+  OPT_PREFIX,
+  OPT_BATCH,
+  OPT_SERVE,
+  OPT_FORMAT,
+  OPT_RANGE,
+  OPT_SHARD,
+  OPT_CHECKPOINT,
+  OPT_RESUME,
+  OPT_STATS,
+  OPT_MIME,
+  OPT_NAMESPACE,
+  OPT_MIN_SIZE,
+  OPT_MAX_SIZE,
 };
 
 #define MAX_ARG_LENGTH 1000
+#define DEFAULT_SERVER_JOBS 4
+#define MAX_JOBS 1024
 int MODE = MODE_ALL;
-bool SHOW_ARTICLES_CONTENT = false;
 const char *FILENAME = NULL;
 const char *URL = NULL;
-const char *MIME_WHITELIST = "text/html,text/plain";
+const char *TITLE = NULL;
+bool BATCH_BY_INDEX = false;
+const char *SERVE_ADDRESS = NULL;
+char **SERVED_FILES = NULL;
+size_t SERVED_FILES_COUNT = 0;
+zim_dump_options_t OPTIONS = {
+  .mime_type_whitelist = "text/html,text/plain",
+  .cluster_cache_size = 64 * 1024 * 1024,
+  .jobs = 1,
+};
+
+static const struct option LONG_OPTIONS[] = {
+  { "help", no_argument, NULL, 'h' },
+  { "cluster-cache", required_argument, NULL, OPT_CLUSTER_CACHE },
+  { "title-order", no_argument, NULL, OPT_TITLE_ORDER },
+  { "prefix", required_argument, NULL, OPT_PREFIX },
+  { "batch", optional_argument, NULL, OPT_BATCH },
+  { "serve", required_argument, NULL, OPT_SERVE },
+  { "format", required_argument, NULL, OPT_FORMAT },
+  { "range", required_argument, NULL, OPT_RANGE },
+  { "shard", required_argument, NULL, OPT_SHARD },
+  { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+  { "resume", no_argument, NULL, OPT_RESUME },
+  { "stats", no_argument, NULL, OPT_STATS },
+  { "mime", required_argument, NULL, OPT_MIME },
+  { "namespace", required_argument, NULL, OPT_NAMESPACE },
+  { "min-size", required_argument, NULL, OPT_MIN_SIZE },
+  { "max-size", required_argument, NULL, OPT_MAX_SIZE },
+  { NULL, 0, NULL, 0 },
+};
+
+/*
+ * Parse the decimal number at the start of `str` into `value`, and set
+ * `end` right after it. As with parse_size(), it must start with a digit,
+ * so negative numbers are refused rather than wrapping around.
+ *
+ * Return non-zero if there is no number, or it doesn't fit in a size_t.
+ */
+static int
+parse_number (const char *str, char **end, size_t *value)
+{
+  if (*str < '0' || *str > '9')
+    return 1;
+
+  errno = 0;
+  unsigned long long int parsed = strtoull (str, end, 10);
+  if (errno == ERANGE || parsed > SIZE_MAX)
+    return 1;
+
+  *value = parsed;
+  return 0;
+}
+
+/*
+ * Parse `<start>:<end>` for --range. Both bounds are optional : `start` is
+ * then 0, and `end` is left as is.
+ *
+ * Return non-zero if `str` is not a valid range.
+ */
+static int
+parse_range (const char *str, size_t *start, size_t *end)
+{
+  char *sep = (char *) str;
+  char *tail = NULL;
+
+  *start = 0;
+  if (*str != ':' && parse_number (str, &sep, start))
+    return 1;
+
+  if (*sep != ':')
+    return 1;
+
+  if (sep[1] == 0)
+    return 0;
+
+  if (parse_number (sep + 1, &tail, end) || *tail != 0)
+    return 1;
+
+  return *end <= *start;
+}
+
+/*
+ * Parse `<i>/<n>` for --shard.
+ *
+ * Return non-zero if `str` is not a valid shard.
+ */
+static int
+parse_shard (const char *str, size_t *shard, size_t *count)
+{
+  char *sep = NULL;
+  char *tail = NULL;
+
+  if (parse_number (str, &sep, shard) || *sep != '/')
+    return 1;
+
+  if (parse_number (sep + 1, &tail, count) || *tail != 0)
+    return 1;
+
+  return *shard >= *count;
+}
 
 /*
  * Handle the various options documented in usage().
@@ -50,25 +259,162 @@ static void
 parse_params (int argc, char **argv)
 {
   int opt = 0;
+  char *end = NULL;
+  bool jobs_given = false;
 
-  while ((opt = getopt (argc, argv, "amht:")) != -1)
+  while ((opt = getopt_long (argc, argv, "acmhj:o:t:T:", LONG_OPTIONS, NULL)) != -1)
     {
       switch (opt)
         {
           case 'a':
-            SHOW_ARTICLES_CONTENT = true;
+            OPTIONS.show_article_content = true;
+            break;
+
+          case 'c':
+            OPTIONS.cluster_order = true;
             break;
 
           case 'm':
             MODE = MODE_MIME;
             break;
 
+          case 'j':
+            jobs_given = true;
+            if (parse_number (optarg, &end, &OPTIONS.jobs) || *end != 0 || OPTIONS.jobs == 0 || OPTIONS.jobs > MAX_JOBS)
+              {
+                fprintf (stderr, "Invalid number of jobs for -j: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case 'o':
+            OPTIONS.reorder_window = strtoul (optarg, NULL, 10);
+            if (OPTIONS.reorder_window == 0)
+              {
+                fprintf (stderr, "Invalid window for -o: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
           case 'h':
             usage (argv[0]);
             exit (0);
 
           case 't':
-            MIME_WHITELIST = optarg;
+            OPTIONS.mime_type_whitelist = optarg;
+            break;
+
+          case 'T':
+            MODE = MODE_TITLE;
+            TITLE = optarg;
+            break;
+
+          case OPT_CLUSTER_CACHE:
+            if (parse_size (optarg, &OPTIONS.cluster_cache_size))
+              {
+                fprintf (stderr, "Invalid size for --cluster-cache: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_TITLE_ORDER:
+            OPTIONS.title_order = true;
+            break;
+
+          case OPT_PREFIX:
+            OPTIONS.url_prefix = optarg;
+            break;
+
+          case OPT_BATCH:
+            if (optarg && strcmp (optarg, "index") == 0)
+              BATCH_BY_INDEX = true;
+            else if (optarg && strcmp (optarg, "url") != 0)
+              {
+                fprintf (stderr, "Invalid value for --batch: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            MODE = MODE_BATCH;
+            OPTIONS.show_article_content = true;
+            break;
+
+          case OPT_FORMAT:
+            if (strcmp (optarg, "text") == 0)
+              OPTIONS.format = ZIM_FORMAT_TEXT;
+            else if (strcmp (optarg, "binary") == 0)
+              OPTIONS.format = ZIM_FORMAT_BINARY;
+            else if (strcmp (optarg, "jsonl") == 0)
+              OPTIONS.format = ZIM_FORMAT_JSONL;
+            else
+              {
+                fprintf (stderr, "Invalid value for --format: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_MIME:
+            OPTIONS.mime_types = optarg;
+            break;
+
+          case OPT_NAMESPACE:
+            OPTIONS.namespaces = optarg;
+            break;
+
+          case OPT_MIN_SIZE:
+            if (parse_size (optarg, &OPTIONS.min_size))
+              {
+                fprintf (stderr, "Invalid size for --min-size: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_MAX_SIZE:
+            if (parse_size (optarg, &OPTIONS.max_size) || OPTIONS.max_size == 0)
+              {
+                fprintf (stderr, "Invalid size for --max-size: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_RANGE:
+            if (parse_range (optarg, &OPTIONS.range_start, &OPTIONS.range_end))
+              {
+                fprintf (stderr, "Invalid value for --range: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_SHARD:
+            if (parse_shard (optarg, &OPTIONS.shard, &OPTIONS.shards_count))
+              {
+                fprintf (stderr, "Invalid value for --shard: %s\n\n", optarg);
+                usage (argv[0]);
+                exit (1);
+              }
+            break;
+
+          case OPT_CHECKPOINT:
+            OPTIONS.checkpoint_path = optarg;
+            break;
+
+          case OPT_RESUME:
+            OPTIONS.resume = true;
+            break;
+
+          case OPT_STATS:
+            stats_enable ();
+            break;
+
+          case OPT_SERVE:
+            MODE = MODE_SERVE;
+            SERVE_ADDRESS = optarg;
             break;
 
           default:
@@ -78,22 +424,53 @@ parse_params (int argc, char **argv)
         }
     }
 
-  if (optind >= argc)
+  if (OPTIONS.title_order && OPTIONS.cluster_order)
     {
-      fprintf (stderr, "You must provide a zimfile.\n\n");
+      fprintf (stderr, "--title-order can't be used with -c.\n\n");
       usage (argv[0]);
       exit (1);
     }
 
-  if (strncmp (argv[optind], "--help", 10) == 0)
+  if (OPTIONS.title_order && OPTIONS.url_prefix)
     {
+      fprintf (stderr, "--title-order can't be used with --prefix.\n\n");
       usage (argv[0]);
-      exit (0);
+      exit (1);
+    }
+
+  if (OPTIONS.max_size && OPTIONS.min_size > OPTIONS.max_size)
+    {
+      fprintf (stderr, "--min-size can't be more than --max-size.\n\n");
+      usage (argv[0]);
+      exit (1);
+    }
+
+  if (OPTIONS.resume && !OPTIONS.checkpoint_path)
+    {
+      fprintf (stderr, "--resume requires --checkpoint.\n\n");
+      usage (argv[0]);
+      exit (1);
+    }
+
+  if (optind >= argc)
+    {
+      fprintf (stderr, "You must provide a zimfile.\n\n");
+      usage (argv[0]);
+      exit (1);
     }
 
   FILENAME = argv[optind];
 
-  if (optind + 1 < argc)
+  if (MODE == MODE_SERVE)
+    {
+      SERVED_FILES = argv + optind;
+      SERVED_FILES_COUNT = argc - optind;
+      if (!jobs_given)
+        OPTIONS.jobs = DEFAULT_SERVER_JOBS;
+      return;
+    }
+
+  if (optind + 1 < argc && MODE != MODE_TITLE && MODE != MODE_BATCH)
     {
       MODE = MODE_SINGLE;
       URL = argv[optind + 1];
@@ -114,16 +491,31 @@ main (int argc, char **argv)
   switch (MODE)
     {
       case MODE_ALL:
-        err = dump_all_articles (FILENAME, SHOW_ARTICLES_CONTENT, MIME_WHITELIST);
+        err = dump_all_articles (FILENAME, &OPTIONS);
         break;
 
       case MODE_MIME:
         err = dump_mime_types (FILENAME);
         break;
 
+      case MODE_TITLE:
+        err = show_article_by_title (FILENAME, TITLE, &OPTIONS);
+        break;
+
+      case MODE_BATCH:
+        err = dump_listed_articles (FILENAME, stdin, BATCH_BY_INDEX, &OPTIONS);
+        break;
+
+      case MODE_SERVE:
+        err = serve_archives (SERVE_ADDRESS, SERVED_FILES, SERVED_FILES_COUNT, &OPTIONS);
+        break;
+
       default:
-        err = show_article (FILENAME, URL);
+        err = show_article (FILENAME, URL, &OPTIONS);
     }
 
+  if (stats_enabled)
+    stats_print_summary ();
+
   return err;
 }
@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "stats.h"
+#include "utils.h"
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_BUFFER_ALIGNMENT 4096
+#define OUTPUT_COPY_MAX (64 * 1024)
+
+/*
+ * Prepare `out` to write on `fd`.
+ */
+void
+output_init (output_t *out, int fd)
+{
+  struct stat st;
+  void *buf = NULL;
+
+  if (posix_memalign (&buf, OUTPUT_BUFFER_ALIGNMENT, OUTPUT_BUFFER_SIZE) != 0)
+    {
+      fprintf (stderr, "output.c : output_init() : can't allocate output buffer.\n");
+      exit (1);
+    }
+
+  out->fd = fd;
+  out->is_pipe = fstat (fd, &st) == 0 && S_ISFIFO (st.st_mode);
+  out->failed = false;
+  out->buf = buf;
+  out->len = 0;
+  out->written = 0;
+}
+
+/*
+ * Write all of `iov`, resuming after partial writes.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+write_iovecs (output_t *out, struct iovec *iov, int count)
+{
+  while (count > 0 && !out->failed)
+    {
+      unsigned long long int started = stats_start ();
+      ssize_t written = writev (out->fd, iov, count);
+      stats_end (STATS_OUTPUT, started);
+      if (written == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          out->failed = true;
+          fprintf (stderr, "output.c : write_iovecs() : can't write output : %s\n", strerror (errno));
+          break;
+        }
+
+      out->written += written;
+      stats_count (STATS_BYTES_WRITTEN, written);
+      while (count > 0 && (size_t) written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          count--;
+        }
+
+      if (count > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+
+  return out->failed;
+}
+
+/*
+ * Write what's buffered.
+ *
+ * Return non-zero in case of error.
+ */
+int
+output_flush (output_t *out)
+{
+  struct iovec iov = { out->buf, out->len };
+
+  if (out->len)
+    write_iovecs (out, &iov, 1);
+
+  out->len = 0;
+  return out->failed;
+}
+
+/*
+ * Flush and release memory used by `out`. `fd` is not closed.
+ *
+ * Return non-zero if anything could not be written.
+ */
+int
+output_close (output_t *out)
+{
+  int err = output_flush (out);
+  free (out->buf);
+  out->buf = NULL;
+  return err;
+}
+
+/*
+ * Write `len` bytes of `data` without copying them when they're big : the
+ * buffer and `data` are then written right away. `data` can be released as
+ * soon as this returns.
+ */
+void
+output_write_ref (output_t *out, const void *data, size_t len)
+{
+  if (len <= OUTPUT_COPY_MAX)
+    {
+      output_write (out, data, len);
+      return;
+    }
+
+  struct iovec iov[2] = {
+    { out->buf, out->len },
+    { (void *) data, len },
+  };
+
+  write_iovecs (out, out->len ? iov : iov + 1, out->len ? 2 : 1);
+  out->len = 0;
+}
+
+/*
+ * Write `len` bytes of `data`, copying them in the buffer.
+ */
+void
+output_write (output_t *out, const void *data, size_t len)
+{
+  if (len > OUTPUT_BUFFER_SIZE - out->len)
+    {
+      if (len > OUTPUT_COPY_MAX)
+        {
+          output_write_ref (out, data, len);
+          return;
+        }
+
+      output_flush (out);
+    }
+
+  memcpy (out->buf + out->len, data, len);
+  out->len += len;
+}
+
+/*
+ * Write the NUL terminated string `str`.
+ */
+void
+output_write_str (output_t *out, const char *str)
+{
+  output_write (out, str, strlen (str));
+}
+
+/*
+ * Write `value` in decimal.
+ */
+void
+output_write_uint (output_t *out, unsigned long long int value)
+{
+  char digits[24];
+  size_t pos = sizeof (digits);
+
+  do
+    {
+      digits[--pos] = '0' + value % 10;
+      value /= 10;
+    }
+  while (value);
+
+  output_write (out, digits + pos, sizeof (digits) - pos);
+}
+
+/*
+ * Write `len` bytes of `data`, which are also found at `offset` in the
+ * file `fd`. When writing to a pipe, they're moved from the file with
+ * splice(), without going through user space.
+ */
+void
+output_write_from_file (output_t *out, const void *data, int fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+  if (out->is_pipe && len > OUTPUT_COPY_MAX)
+    {
+      if (output_flush (out))
+        return;
+
+      size_t done = 0;
+      while (done < len)
+        {
+          unsigned long long int started = stats_start ();
+          ssize_t moved = splice (fd, &offset, out->fd, NULL, len - done, SPLICE_F_MORE);
+          stats_end (STATS_OUTPUT, started);
+          if (moved == -1 && errno == EINTR)
+            continue;
+
+          if (moved <= 0)
+            break;
+
+          done += moved;
+          out->written += moved;
+          stats_count (STATS_BYTES_WRITTEN, moved);
+        }
+
+      if (done == len)
+        return;
+
+      // splice() is not supported for this file, write the rest from memory
+      data = (const char *) data + done;
+      len -= done;
+    }
+#else
+  (void) fd;
+  (void) offset;
+#endif
+
+  output_write_ref (out, data, len);
+}
+
+/*
+ * Mark the bytes of `word` which must be looked at one by one in a JSON
+ * string : control characters, `"` and `\`, which are escaped, and bytes
+ * above 0x7F, which must be valid UTF-8. The result has the high bit of each
+ * such byte set, and is zero if there is none. Bytes after a marked one may
+ * be marked too, but the first marked byte is always right.
+ */
+static uint64_t
+mark_json_escapes (uint64_t word)
+{
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  uint64_t quotes = word ^ (ones * '"');
+  uint64_t backslashes = word ^ (ones * '\\');
+
+  uint64_t found = ((word - ones * 0x20) & ~word)
+    | ((quotes - ones) & ~quotes)
+    | ((backslashes - ones) & ~backslashes);
+
+  return (found | word) & highs;
+}
+
+static bool
+byte_needs_json_escape (unsigned char c)
+{
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+/*
+ * Tell the length of the UTF-8 sequence starting `str`, which has `len`
+ * bytes left, or 0 if it's not a valid one. Overlong forms, surrogates and
+ * code points above U+10FFFF are not valid.
+ */
+static size_t
+utf8_sequence_length (const unsigned char *str, size_t len)
+{
+  size_t n = 0;
+  unsigned char low = 0x80;
+  unsigned char high = 0xBF;
+
+  if (str[0] >= 0xC2 && str[0] <= 0xDF)
+    n = 2;
+  else if (str[0] >= 0xE0 && str[0] <= 0xEF)
+    {
+      n = 3;
+      if (str[0] == 0xE0) low = 0xA0;
+      if (str[0] == 0xED) high = 0x9F;
+    }
+  else if (str[0] >= 0xF0 && str[0] <= 0xF4)
+    {
+      n = 4;
+      if (str[0] == 0xF0) low = 0x90;
+      if (str[0] == 0xF4) high = 0x8F;
+    }
+  else
+    return 0;
+
+  if (n > len)
+    return 0;
+
+  for (size_t i = 1; i < n; i++)
+    {
+      if (str[i] < low || str[i] > high)
+        return 0;
+      low = 0x80;
+      high = 0xBF;
+    }
+
+  return n;
+}
+
+/*
+ * Write `len` bytes of `str` as a quoted JSON string.
+ *
+ * Input is scanned 8 bytes at a time, and runs of bytes which don't need
+ * escaping are copied as a whole, valid UTF-8 sequences included. Bytes
+ * which aren't part of one are written as U+FFFD, so output is always valid
+ * JSON, whatever `str` holds.
+ */
+void
+output_write_json_string (output_t *out, const char *str, size_t len)
+{
+  const unsigned char *bytes = (const unsigned char *) str;
+  size_t start = 0;
+
+  output_write (out, "\"", 1);
+
+  while (start < len)
+    {
+      size_t end = start;
+      uint64_t word = 0;
+
+      while (end < len)
+        {
+          while (end + 8 <= len)
+            {
+              memcpy (&word, str + end, 8);
+              uint64_t marks = mark_json_escapes (word);
+              if (marks)
+                {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                  end += __builtin_ctzll (marks) / 8;
+#endif
+                  break;
+                }
+              end += 8;
+            }
+
+          if (end == len)
+            break;
+
+          if (bytes[end] < 0x80)
+            {
+              if (byte_needs_json_escape (bytes[end]))
+                break;
+              end++;
+              continue;
+            }
+
+          // non-latin text is mostly made of such sequences, one after the other
+          size_t n = 0;
+          while (end < len && bytes[end] >= 0x80 && (n = utf8_sequence_length (bytes + end, len - end)))
+            end += n;
+          if (n == 0)
+            break;
+        }
+
+      output_write_ref (out, str + start, end - start);
+      if (end == len)
+        break;
+
+      if (out->len + 6 > OUTPUT_BUFFER_SIZE)
+        output_flush (out);
+
+      char *escape = out->buf + out->len;
+      unsigned char c = bytes[end];
+      escape[0] = '\\';
+      out->len += 2;
+
+      switch (c)
+        {
+          case '"':
+          case '\\':
+            escape[1] = c;
+            break;
+
+          case '\n':
+            escape[1] = 'n';
+            break;
+
+          case '\r':
+            escape[1] = 'r';
+            break;
+
+          case '\t':
+            escape[1] = 't';
+            break;
+
+          case '\b':
+            escape[1] = 'b';
+            break;
+
+          case '\f':
+            escape[1] = 'f';
+            break;
+
+          default:
+            escape[1] = 'u';
+            if (c >= 0x80)
+              memcpy (escape + 2, "fffd", 4);
+            else
+              {
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = "0123456789abcdef"[c >> 4];
+                escape[5] = "0123456789abcdef"[c & 0x0F];
+              }
+            out->len += 4;
+        }
+
+      start = end + 1;
+    }
+
+  output_write (out, "\"", 1);
+}
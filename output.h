@@ -0,0 +1,85 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Buffered writer on a file descriptor, used to print articles.
+ *
+ * Small writes are copied in a big buffer, which is flushed once full.
+ * Large blobs are written from where they are, along with the buffer, in a
+ * single writev(), or moved from the zimfile with splice() when writing to
+ * a pipe.
+ *
+ * `written` counts bytes which made it to `fd`.
+ */
+typedef struct {
+  int fd;
+  bool is_pipe;
+  bool failed;
+  char *buf;
+  size_t len;
+  unsigned long long int written;
+} output_t;
+
+/*
+ * Prepare `out` to write on `fd`.
+ */
+void output_init (output_t *out, int fd);
+
+/*
+ * Flush and release memory used by `out`. `fd` is not closed.
+ *
+ * Return non-zero if anything could not be written.
+ */
+int output_close (output_t *out);
+
+/*
+ * Write what's buffered.
+ *
+ * Return non-zero in case of error.
+ */
+int output_flush (output_t *out);
+
+/*
+ * Write `len` bytes of `data`, copying them in the buffer.
+ */
+void output_write (output_t *out, const void *data, size_t len);
+
+/*
+ * Write the NUL terminated string `str`.
+ */
+void output_write_str (output_t *out, const char *str);
+
+/*
+ * Write `value` in decimal.
+ */
+void output_write_uint (output_t *out, unsigned long long int value);
+
+/*
+ * Write `len` bytes of `data` without copying them when they're big : the
+ * buffer and `data` are then written right away. `data` can be released as
+ * soon as this returns.
+ */
+void output_write_ref (output_t *out, const void *data, size_t len);
+
+/*
+ * Write `len` bytes of `data`, which are also found at `offset` in the
+ * file `fd`. When writing to a pipe, they're moved from the file with
+ * splice(), without going through user space.
+ */
+void output_write_from_file (output_t *out, const void *data, int fd, off_t offset, size_t len);
+
+/*
+ * Write `len` bytes of `str` as a quoted JSON string.
+ *
+ * Input is scanned 8 bytes at a time, and runs of bytes which don't need
+ * escaping are copied as a whole, valid UTF-8 sequences included. Bytes
+ * which aren't part of one are written as U+FFFD, so output is always valid
+ * JSON, whatever `str` holds.
+ */
+void output_write_json_string (output_t *out, const char *str, size_t len);
+
+#endif
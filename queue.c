@@ -0,0 +1,91 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "utils.h"
+
+/*
+ * Prepare `queue` to hold at most `capacity` items.
+ */
+void
+queue_init (queue_t *queue, size_t capacity)
+{
+  queue->items = xalloc (capacity * sizeof (*queue->items));
+  queue->capacity = capacity;
+  queue->first = 0;
+  queue->len = 0;
+  queue->closed = false;
+  pthread_mutex_init (&queue->lock, NULL);
+  pthread_cond_init (&queue->not_empty, NULL);
+  pthread_cond_init (&queue->not_full, NULL);
+}
+
+/*
+ * Release memory used by `queue`. It must not be used by any thread anymore.
+ */
+void
+queue_destroy (queue_t *queue)
+{
+  free (queue->items);
+  queue->items = NULL;
+  pthread_mutex_destroy (&queue->lock);
+  pthread_cond_destroy (&queue->not_empty);
+  pthread_cond_destroy (&queue->not_full);
+}
+
+/*
+ * Add `item` at the end of the queue, waiting for some room if it's full.
+ */
+void
+queue_push (queue_t *queue, void *item)
+{
+  pthread_mutex_lock (&queue->lock);
+
+  while (queue->len == queue->capacity)
+    pthread_cond_wait (&queue->not_full, &queue->lock);
+
+  queue->items[(queue->first + queue->len) % queue->capacity] = item;
+  queue->len++;
+
+  pthread_cond_signal (&queue->not_empty);
+  pthread_mutex_unlock (&queue->lock);
+}
+
+/*
+ * Take the first item of the queue, waiting for one if it's empty.
+ *
+ * Return NULL once the queue is closed and empty.
+ */
+void *
+queue_pop (queue_t *queue)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock (&queue->lock);
+
+  while (queue->len == 0 && !queue->closed)
+    pthread_cond_wait (&queue->not_empty, &queue->lock);
+
+  if (queue->len > 0)
+    {
+      item = queue->items[queue->first];
+      queue->first = (queue->first + 1) % queue->capacity;
+      queue->len--;
+      pthread_cond_signal (&queue->not_full);
+    }
+
+  pthread_mutex_unlock (&queue->lock);
+  return item;
+}
+
+/*
+ * Tell consumers no more item will be pushed.
+ */
+void
+queue_close (queue_t *queue)
+{
+  pthread_mutex_lock (&queue->lock);
+  queue->closed = true;
+  pthread_cond_broadcast (&queue->not_empty);
+  pthread_mutex_unlock (&queue->lock);
+}
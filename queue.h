@@ -0,0 +1,49 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded FIFO queue of pointers, safe to share between threads.
+ */
+typedef struct {
+  void **items;
+  size_t capacity;
+  size_t first;
+  size_t len;
+  bool closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} queue_t;
+
+/*
+ * Prepare `queue` to hold at most `capacity` items.
+ */
+void queue_init (queue_t *queue, size_t capacity);
+
+/*
+ * Release memory used by `queue`. It must not be used by any thread anymore.
+ */
+void queue_destroy (queue_t *queue);
+
+/*
+ * Add `item` at the end of the queue, waiting for some room if it's full.
+ */
+void queue_push (queue_t *queue, void *item);
+
+/*
+ * Take the first item of the queue, waiting for one if it's empty.
+ *
+ * Return NULL once the queue is closed and empty.
+ */
+void *queue_pop (queue_t *queue);
+
+/*
+ * Tell consumers no more item will be pushed.
+ */
+void queue_close (queue_t *queue);
+
+#endif
@@ -0,0 +1,636 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "server.h"
+#include "utils.h"
+#include "zim.h"
+
+#define MAX_REQUEST_SIZE 8192
+#define LISTEN_BACKLOG 128
+#define CLIENT_TIMEOUT_SECONDS 10
+#define CLIENTS_PER_THREAD 16
+#define ACCEPT_RETRY_MS 100
+
+typedef struct {
+  char *name;
+  zim_archive_t *archive;
+} served_archive_t;
+
+typedef struct {
+  served_archive_t *archives;
+  size_t archives_count;
+  queue_t clients;
+} server_t;
+
+typedef struct {
+  int fd;
+} client_t;
+
+/*
+ * handle_stop_signal() writes in `stop_pipe[1]` to wake the accept loop of
+ * serve_archives() up, which then stops.
+ */
+static int stop_pipe[2] = { -1, -1 };
+
+/*
+ * Name of an archive in request paths : the file name of the zimfile,
+ * without its `.zim` extension.
+ */
+static char *
+archive_name (const char *path)
+{
+  const char *slash = strrchr (path, '/');
+  char *name = strdup (slash ? slash + 1 : path);
+
+  size_t len = strlen (name);
+  if (len > 4 && strcmp (name + len - 4, ".zim") == 0)
+    name[len - 4] = 0;
+
+  return name;
+}
+
+static served_archive_t *
+find_archive (server_t *server, const char *name)
+{
+  for (size_t i = 0; i < server->archives_count; i++)
+    if (strcmp (server->archives[i].name, name) == 0)
+      return &server->archives[i];
+
+  return NULL;
+}
+
+/*
+ * Value of the hexadecimal digit `c`, or -1 if it's not one.
+ */
+static int
+hex_value (char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Decode %XX sequences of `str` in place, and `+` as spaces if `plus` is
+ * true (query strings).
+ *
+ * Return non-zero if a sequence is malformed, or decodes to a NUL byte
+ * which would cut the string short.
+ */
+static int
+percent_decode (char *str, bool plus)
+{
+  char *out = str;
+
+  for (char *in = str; *in; in++)
+    {
+      if (*in == '%')
+        {
+          int high = hex_value (in[1]);
+          int low = high == -1 ? -1 : hex_value (in[2]);
+          if (low == -1 || (high == 0 && low == 0))
+            return 1;
+
+          *out++ = (char) (high * 16 + low);
+          in += 2;
+          continue;
+        }
+
+      *out++ = (plus && *in == '+') ? ' ' : *in;
+    }
+
+  *out = 0;
+  return 0;
+}
+
+/*
+ * Read the request line and headers, up to the empty line.
+ *
+ * Return non-zero if the request is incomplete or too big.
+ */
+static int
+read_request (int fd, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  while (len < size - 1)
+    {
+      ssize_t r = recv (fd, buf + len, size - 1 - len, 0);
+      if (r == -1 && errno == EINTR)
+        continue;
+
+      if (r <= 0)
+        return 1;
+
+      len += r;
+      buf[len] = 0;
+
+      if (strstr (buf, "\r\n\r\n") || strstr (buf, "\n\n"))
+        return 0;
+    }
+
+  return 1;
+}
+
+/*
+ * Send the status line and headers of a response whose body is `len`
+ * bytes long.
+ */
+static void
+send_headers (FILE *out, int status, const char *reason, const char *content_type, size_t len)
+{
+  fprintf (out, "HTTP/1.0 %d %s\r\n", status, reason);
+  fprintf (out, "Content-Type: %s\r\n", content_type);
+  fprintf (out, "Content-Length: %zu\r\n", len);
+  fputs ("Connection: close\r\n\r\n", out);
+}
+
+static void
+send_response (FILE *out, int status, const char *reason, const char *content_type, const char *body, size_t len)
+{
+  send_headers (out, status, reason, content_type, len);
+  fwrite (body, 1, len, out);
+}
+
+static void
+send_error (FILE *out, int status, const char *reason)
+{
+  char body[128];
+  int len = snprintf (body, sizeof (body), "%d %s\n", status, reason);
+  send_response (out, status, reason, "text/plain", body, len);
+}
+
+/*
+ * Answer a request for `target` on `out`. Supported paths are :
+ *
+ *   /                          list of served archives
+ *   /<archive>/url/<url>       content of the article at <url>
+ *   /<archive>/index/<n>       content of the article at position <n>
+ *   /<archive>/list            list of articles
+ *   /<archive>/list?prefix=<p> list of articles whose url starts with <p>
+ */
+static void
+answer_request (server_t *server, char *target, FILE *out)
+{
+  char *query = strchr (target, '?');
+  if (query) *query++ = 0;
+
+  if (strcmp (target, "/") == 0)
+    {
+      size_t len = 0;
+      for (size_t i = 0; i < server->archives_count; i++)
+        len += strlen (server->archives[i].name) + 1;
+
+      send_headers (out, 200, "OK", "text/plain", len);
+      for (size_t i = 0; i < server->archives_count; i++)
+        fprintf (out, "%s\n", server->archives[i].name);
+      return;
+    }
+
+  char *name = target + 1;
+  char *kind = strchr (name, '/');
+  if (!kind)
+    {
+      send_error (out, 404, "Not Found");
+      return;
+    }
+  *kind++ = 0;
+
+  if (percent_decode (name, false))
+    {
+      send_error (out, 400, "Bad Request");
+      return;
+    }
+
+  served_archive_t *served = find_archive (server, name);
+  if (!served)
+    {
+      send_error (out, 404, "Not Found");
+      return;
+    }
+
+  if (strcmp (kind, "list") == 0)
+    {
+      char *prefix = NULL;
+      if (query && strncmp (query, "prefix=", 7) == 0)
+        {
+          prefix = query + 7;
+          char *next = strchr (prefix, '&');
+          if (next) *next = 0;
+          if (percent_decode (prefix, true))
+            {
+              send_error (out, 400, "Bad Request");
+              return;
+            }
+        }
+
+      fputs ("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n", out);
+      fflush (out);
+      zim_list_articles (served->archive, prefix, fileno (out));
+      return;
+    }
+
+  char *key = strchr (kind, '/');
+  if (!key)
+    {
+      send_error (out, 404, "Not Found");
+      return;
+    }
+  *key++ = 0;
+
+  bool by_index = strcmp (kind, "index") == 0;
+  if (!by_index && strcmp (kind, "url") != 0)
+    {
+      send_error (out, 404, "Not Found");
+      return;
+    }
+
+  if (percent_decode (key, false))
+    {
+      send_error (out, 400, "Bad Request");
+      return;
+    }
+
+  zim_article_t article = { 0 };
+  if (zim_read_article (served->archive, key, by_index, &article))
+    {
+      send_error (out, 404, "Not Found");
+      return;
+    }
+
+  send_response (out, 200, "OK", article.mime_type, article.data, article.len);
+  zim_release_article (served->archive, &article);
+}
+
+/*
+ * Read the request of `client` and answer it. The connection is closed
+ * afterward.
+ */
+static void
+handle_client (server_t *server, int fd)
+{
+  char request[MAX_REQUEST_SIZE];
+  struct timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  FILE *out = fdopen (fd, "w");
+  if (!out)
+    {
+      close (fd);
+      return;
+    }
+
+  if (read_request (fd, request, sizeof (request)))
+    {
+      send_error (out, 400, "Bad Request");
+      fclose (out);
+      return;
+    }
+
+  char *saveptr = NULL;
+  char *method = strtok_r (request, " ", &saveptr);
+  char *target = method ? strtok_r (NULL, " \r\n", &saveptr) : NULL;
+
+  if (!target || target[0] != '/')
+    send_error (out, 400, "Bad Request");
+  else if (strcmp (method, "GET") != 0)
+    send_error (out, 405, "Method Not Allowed");
+  else
+    answer_request (server, target, out);
+
+  fclose (out);
+}
+
+static void *
+run_server_worker (void *data)
+{
+  server_t *server = data;
+  client_t *client = NULL;
+
+  while ((client = queue_pop (&server->clients)))
+    {
+      handle_client (server, client->fd);
+      free (client);
+    }
+
+  return NULL;
+}
+
+/*
+ * Tell if `address` is a port number rather than a unix socket path.
+ */
+static bool
+is_port_number (const char *address)
+{
+  char *end = NULL;
+  strtoul (address, &end, 10);
+  return *address && *end == 0;
+}
+
+/*
+ * Tell if a server accepts connections on the unix socket `addr`. Only
+ * sockets which refuse them are stale : when it can't be told, the socket
+ * is deemed live, so it's not taken from its owner.
+ */
+static bool
+is_socket_live (const struct sockaddr_un *addr)
+{
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return true;
+
+  bool live = connect (fd, (const struct sockaddr *) addr, sizeof (*addr)) == 0 || errno != ECONNREFUSED;
+  close (fd);
+  return live;
+}
+
+/*
+ * Listen on localhost if `address` is a port number, or on a unix socket
+ * at path `address` otherwise. A stale unix socket is replaced, but not
+ * one another server is listening on.
+ *
+ * Return -1 in case of error.
+ */
+static int
+open_listening_socket (const char *address)
+{
+  int fd = -1;
+
+  if (is_port_number (address))
+    {
+      unsigned long int port = strtoul (address, NULL, 10);
+      struct sockaddr_in addr = { 0 };
+      int yes = 1;
+
+      if (port == 0 || port > 65535)
+        {
+          fprintf (stderr, "server.c : open_listening_socket() : invalid port : %s\n", address);
+          return -1;
+        }
+
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons (port);
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+      fd = socket (AF_INET, SOCK_STREAM, 0);
+      if (fd != -1)
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+
+      if (fd == -1 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+        goto error;
+    }
+  else
+    {
+      struct sockaddr_un addr = { 0 };
+      struct stat st;
+
+      if (strlen (address) >= sizeof (addr.sun_path))
+        {
+          fprintf (stderr, "server.c : open_listening_socket() : socket path is too long : %s\n", address);
+          return -1;
+        }
+
+      addr.sun_family = AF_UNIX;
+      strcpy (addr.sun_path, address);
+
+      if (stat (address, &st) == 0 && S_ISSOCK (st.st_mode))
+        {
+          if (is_socket_live (&addr))
+            {
+              fprintf (stderr, "server.c : open_listening_socket() : a server is already listening on %s\n", address);
+              return -1;
+            }
+
+          unlink (address);
+        }
+
+      fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (fd == -1 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+        goto error;
+    }
+
+  if (listen (fd, LISTEN_BACKLOG) == -1)
+    goto error;
+
+  return fd;
+
+  error:
+  fprintf (stderr, "server.c : open_listening_socket() : can't listen on %s : %s\n", address, strerror (errno));
+  if (fd != -1) close (fd);
+  return -1;
+}
+
+static void
+handle_stop_signal (int signum)
+{
+  (void) signum;
+  int saved_errno = errno;
+  char byte = 0;
+  ssize_t written = write (stop_pipe[1], &byte, 1);
+  (void) written;
+  errno = saved_errno;
+}
+
+/*
+ * Make SIGINT and SIGTERM stop serve_archives(), saving the previous
+ * handlers in `previous`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+catch_stop_signals (struct sigaction previous[2])
+{
+  struct sigaction action = { 0 };
+
+  if (pipe (stop_pipe) == -1)
+    {
+      fprintf (stderr, "server.c : catch_stop_signals() : can't create pipe : %s\n", strerror (errno));
+      return 1;
+    }
+
+  fcntl (stop_pipe[1], F_SETFL, O_NONBLOCK);
+  action.sa_handler = handle_stop_signal;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, &previous[0]);
+  sigaction (SIGTERM, &action, &previous[1]);
+  return 0;
+}
+
+static void
+release_stop_signals (const struct sigaction previous[2])
+{
+  sigaction (SIGINT, &previous[0], NULL);
+  sigaction (SIGTERM, &previous[1], NULL);
+  close (stop_pipe[0]);
+  close (stop_pipe[1]);
+  stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+/*
+ * Serve articles of the zimfiles at `paths` over HTTP, until SIGINT or
+ * SIGTERM. Requests being answered are then finished, and the unix socket
+ * is removed.
+ *
+ * `address` is either a port number, to listen on localhost, or the path
+ * of a unix socket. `options->jobs` threads answer requests, with all
+ * archives kept open and their cluster caches shared between requests.
+ *
+ * Return non-zero in case of error.
+ */
+int
+serve_archives (const char *address, char **paths, size_t paths_count, const zim_dump_options_t *options)
+{
+  int err = 0;
+  int listener = -1;
+  bool catching_signals = false;
+  struct sigaction previous_actions[2];
+  sigset_t stop_signals;
+  size_t workers_count = 0;
+  int accept_errno = 0;
+  pthread_t *workers = xalloc (options->jobs * sizeof (*workers));
+  server_t server = { 0 };
+
+  server.archives = xalloc (paths_count * sizeof (*server.archives));
+  queue_init (&server.clients, options->jobs * CLIENTS_PER_THREAD);
+
+  for (size_t i = 0; i < paths_count; i++)
+    {
+      server.archives[i].archive = zim_open (paths[i], options);
+      if (!server.archives[i].archive)
+        {
+          err = 1;
+          goto cleanup;
+        }
+
+      server.archives[i].name = archive_name (paths[i]);
+      server.archives_count++;
+    }
+
+  listener = open_listening_socket (address);
+  if (listener == -1)
+    {
+      err = 1;
+      goto cleanup;
+    }
+
+  // polled along with signals, so accept() must not block if a client is gone
+  fcntl (listener, F_SETFL, O_NONBLOCK);
+  signal (SIGPIPE, SIG_IGN);
+
+  if (catch_stop_signals (previous_actions))
+    {
+      err = 1;
+      goto cleanup;
+    }
+  catching_signals = true;
+
+  // workers inherit the blocked signals, so only this thread is interrupted
+  sigemptyset (&stop_signals);
+  sigaddset (&stop_signals, SIGINT);
+  sigaddset (&stop_signals, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &stop_signals, NULL);
+
+  for (size_t i = 0; i < options->jobs; i++)
+    {
+      if (pthread_create (&workers[workers_count], NULL, run_server_worker, &server) != 0)
+        {
+          fprintf (stderr, "server.c : serve_archives() : can't start worker thread.\n");
+          break;
+        }
+      workers_count++;
+    }
+
+  pthread_sigmask (SIG_UNBLOCK, &stop_signals, NULL);
+
+  if (workers_count == 0)
+    {
+      err = 1;
+      goto cleanup;
+    }
+
+  while (true)
+    {
+      struct pollfd fds[2] = { { listener, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+      if (poll (fds, 2, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          err = 1;
+          fprintf (stderr, "server.c : serve_archives() : can't wait for connections : %s\n", strerror (errno));
+          break;
+        }
+
+      if (fds[1].revents)
+        break;
+
+      int fd = accept (listener, NULL, NULL);
+      if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+            continue;
+
+          if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK || errno == EOPNOTSUPP)
+            {
+              err = 1;
+              fprintf (stderr, "server.c : serve_archives() : can't accept connection : %s\n", strerror (errno));
+              break;
+            }
+
+          // running out of file descriptors or memory doesn't last, and the
+          // listener stays readable meanwhile, so wait rather than spin.
+          // The same error is only logged once in a row.
+          if (errno != accept_errno)
+            fprintf (stderr, "server.c : serve_archives() : can't accept connection, retrying : %s\n", strerror (errno));
+          accept_errno = errno;
+          poll (&fds[1], 1, ACCEPT_RETRY_MS);
+          continue;
+        }
+
+      accept_errno = 0;
+
+      client_t *client = xalloc (sizeof (*client));
+      client->fd = fd;
+      queue_push (&server.clients, client);
+    }
+
+  cleanup:
+  queue_close (&server.clients);
+  for (size_t i = 0; i < workers_count; i++)
+    pthread_join (workers[i], NULL);
+  queue_destroy (&server.clients);
+
+  if (catching_signals) release_stop_signals (previous_actions);
+  if (listener != -1)
+    {
+      close (listener);
+      if (!is_port_number (address)) unlink (address);
+    }
+  for (size_t i = 0; i < server.archives_count; i++)
+    {
+      zim_close (server.archives[i].archive);
+      free (server.archives[i].name);
+    }
+
+  free (server.archives);
+  free (workers);
+  return err;
+}
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#include "zim.h"
+
+/*
+ * Serve articles of the zimfiles at `paths` over HTTP, until SIGINT or
+ * SIGTERM. Requests being answered are then finished, and the unix socket
+ * is removed. Connections which can't be accepted for a while, like when
+ * running out of file descriptors, don't stop the server.
+ *
+ * `address` is either a port number, to listen on localhost, or the path
+ * of a unix socket. `options->jobs` threads answer requests, with all
+ * archives kept open and their cluster caches shared between requests.
+ *
+ * Return non-zero in case of error.
+ */
+int serve_archives (const char *address, char **paths, size_t paths_count, const zim_dump_options_t *options);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_PROGRESS_INTERVAL 10
+#define NS_PER_SECOND 1000000000ULL
+
+bool stats_enabled = false;
+
+/*
+ * Counters are only added to, with relaxed atomics : nothing is ordered
+ * by them, so they stay cheap when several threads update them.
+ */
+static _Atomic unsigned long long int phase_times[STATS_PHASES_COUNT];
+static _Atomic unsigned long long int counters[STATS_COUNTERS_COUNT];
+static unsigned long long int started_at;
+static _Atomic unsigned long long int last_progress;
+
+static const char *PHASE_NAMES[STATS_PHASES_COUNT] = {
+  [STATS_DIRECTORY] = "directory parsing",
+  [STATS_CLUSTER_READ] = "cluster reads",
+  [STATS_XZ] = "xz decompression",
+  [STATS_ZSTD] = "zstd decompression",
+  [STATS_OUTPUT] = "output writes",
+};
+
+static unsigned long long int
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static unsigned long long int
+get_counter (stats_counter_t counter)
+{
+  return atomic_load_explicit (&counters[counter], memory_order_relaxed);
+}
+
+static double
+seconds (unsigned long long int ns)
+{
+  return (double) ns / NS_PER_SECOND;
+}
+
+static double
+megabytes (unsigned long long int bytes)
+{
+  return bytes / (1024.0 * 1024.0);
+}
+
+/*
+ * Start collecting stats, and printing progress on STDERR.
+ */
+void
+stats_enable (void)
+{
+  stats_enabled = true;
+  started_at = now ();
+  last_progress = started_at;
+}
+
+/*
+ * Get the time at which a phase starts, to give to stats_end(). Return 0
+ * when stats are disabled.
+ */
+unsigned long long int
+stats_start (void)
+{
+  return stats_enabled ? now () : 0;
+}
+
+/*
+ * Add the time elapsed since `start` to `phase`.
+ */
+void
+stats_end (stats_phase_t phase, unsigned long long int start)
+{
+  if (!stats_enabled) return;
+  atomic_fetch_add_explicit (&phase_times[phase], now () - start, memory_order_relaxed);
+}
+
+/*
+ * Add `value` to `counter`.
+ */
+void
+stats_count (stats_counter_t counter, unsigned long long int value)
+{
+  if (!stats_enabled) return;
+  atomic_fetch_add_explicit (&counters[counter], value, memory_order_relaxed);
+}
+
+/*
+ * Print a progress line on STDERR if it's been a while since the last one.
+ */
+void
+stats_progress (void)
+{
+  if (!stats_enabled) return;
+
+  unsigned long long int time = now ();
+  unsigned long long int last = atomic_load_explicit (&last_progress, memory_order_relaxed);
+  if (time - last < STATS_PROGRESS_INTERVAL * NS_PER_SECOND)
+    return;
+
+  if (!atomic_compare_exchange_strong (&last_progress, &last, time))
+    return;
+
+  double elapsed = seconds (time - started_at);
+  unsigned long long int articles = get_counter (STATS_ARTICLES);
+  fprintf (stderr, "stats : %.1f s : %llu articles (%.1f/s), %.1f MB written\n",
+           elapsed, articles, articles / elapsed, megabytes (get_counter (STATS_BYTES_WRITTEN)));
+}
+
+/*
+ * Print the summary of what was collected on STDERR.
+ */
+void
+stats_print_summary (void)
+{
+  struct rusage usage;
+  double elapsed = seconds (now () - started_at);
+  unsigned long long int articles = get_counter (STATS_ARTICLES);
+  unsigned long long int hits = get_counter (STATS_CACHE_HITS);
+  unsigned long long int misses = get_counter (STATS_CACHE_MISSES);
+
+  fprintf (stderr, "stats : wall time           %.3f s\n", elapsed);
+  fprintf (stderr, "stats : articles printed    %llu (%.1f/s)\n", articles, elapsed > 0 ? articles / elapsed : 0);
+  fprintf (stderr, "stats : entries parsed      %llu\n", get_counter (STATS_ENTRIES));
+  fprintf (stderr, "stats : redirect scan       %llu entries\n", get_counter (STATS_REDIRECT_SCAN));
+  fprintf (stderr, "stats : redirects followed  %llu\n", get_counter (STATS_REDIRECTS));
+
+  for (int phase = 0; phase < STATS_PHASES_COUNT; phase++)
+    fprintf (stderr, "stats : %-19s %.3f s\n", PHASE_NAMES[phase], seconds (phase_times[phase]));
+
+  fprintf (stderr, "stats : bytes read          %.1f MB\n", megabytes (get_counter (STATS_BYTES_READ)));
+  fprintf (stderr, "stats : xz clusters         %llu, %.1f MB decompressed to %.1f MB\n",
+           get_counter (STATS_XZ_CLUSTERS), megabytes (get_counter (STATS_XZ_IN)), megabytes (get_counter (STATS_XZ_OUT)));
+  fprintf (stderr, "stats : zstd clusters       %llu, %.1f MB decompressed to %.1f MB\n",
+           get_counter (STATS_ZSTD_CLUSTERS), megabytes (get_counter (STATS_ZSTD_IN)), megabytes (get_counter (STATS_ZSTD_OUT)));
+  fprintf (stderr, "stats : stored clusters     %llu\n", get_counter (STATS_STORED_CLUSTERS));
+  fprintf (stderr, "stats : clusters loaded     %llu, %llu distinct\n", misses, get_counter (STATS_DISTINCT_CLUSTERS));
+  fprintf (stderr, "stats : cluster cache       %llu hits, %llu misses (%.1f%% hit rate)\n",
+           hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0);
+  fprintf (stderr, "stats : bytes written       %.1f MB\n", megabytes (get_counter (STATS_BYTES_WRITTEN)));
+
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+    fprintf (stderr, "stats : peak RSS            %.1f MB\n", usage.ru_maxrss / 1024.0);
+}
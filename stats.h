@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+
+/*
+ * Phases whose time is measured. Times are summed over all threads, so
+ * with `-j`, decompression can take longer than the whole run.
+ */
+typedef enum {
+  STATS_DIRECTORY,
+  STATS_CLUSTER_READ,
+  STATS_XZ,
+  STATS_ZSTD,
+  STATS_OUTPUT,
+  STATS_PHASES_COUNT,
+} stats_phase_t;
+
+typedef enum {
+  STATS_ENTRIES,
+  STATS_REDIRECT_SCAN,
+  STATS_BYTES_READ,
+  STATS_XZ_CLUSTERS,
+  STATS_XZ_IN,
+  STATS_XZ_OUT,
+  STATS_ZSTD_CLUSTERS,
+  STATS_ZSTD_IN,
+  STATS_ZSTD_OUT,
+  STATS_STORED_CLUSTERS,
+  STATS_DISTINCT_CLUSTERS,
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_REDIRECTS,
+  STATS_ARTICLES,
+  STATS_BYTES_WRITTEN,
+  STATS_COUNTERS_COUNT,
+} stats_counter_t;
+
+/*
+ * Whether stats_enable() was called. Counters are left alone otherwise.
+ */
+extern bool stats_enabled;
+
+/*
+ * Start collecting stats, and printing progress on STDERR.
+ */
+void stats_enable (void);
+
+/*
+ * Get the time at which a phase starts, to give to stats_end(). Return 0
+ * when stats are disabled.
+ */
+unsigned long long int stats_start (void);
+
+/*
+ * Add the time elapsed since `start` to `phase`.
+ */
+void stats_end (stats_phase_t phase, unsigned long long int start);
+
+/*
+ * Add `value` to `counter`.
+ */
+void stats_count (stats_counter_t counter, unsigned long long int value);
+
+/*
+ * Print a progress line on STDERR if it's been a while since the last one.
+ */
+void stats_progress (void);
+
+/*
+ * Print the summary of what was collected on STDERR.
+ */
+void stats_print_summary (void);
+
+#endif
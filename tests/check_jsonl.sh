@@ -0,0 +1,44 @@
+#!/bin/sh
+# check_jsonl.sh <zim_dump> <zimgen> <dir>
+#
+# Dump an archive with images and text which isn't valid UTF-8, generated in
+# <dir>, with --format=jsonl, and check that every line is valid JSON :
+# binary content is null, even when whitelisted, and invalid bytes are
+# replaced by U+FFFD.
+
+set -e
+
+zim_dump=$1
+zimgen=$2
+dir=$3
+
+mkdir -p "$dir"
+"$zimgen" -n 2000 -m 8 -b 2K -x "$dir/jsonl.zim"
+"$zim_dump" --format=jsonl -a -t text/,image/,application/ "$dir/jsonl.zim" > "$dir/jsonl.out"
+
+python3 - "$dir/jsonl.out" <<'CHECK'
+import json
+import sys
+
+binary_types = ("image/png", "image/jpeg", "application/pdf")
+counts = {"articles": 0, "binary": 0, "accented": 0, "replaced": 0}
+
+# decoding fails on the first byte which isn't valid UTF-8
+with open(sys.argv[1], encoding="utf-8") as lines:
+    for line in lines:
+        article = json.loads(line)
+        content = article.get("content")
+        counts["articles"] += 1
+
+        if article["mime"] in binary_types:
+            assert content is None, "binary content for %s" % article["url"]
+            counts["binary"] += 1
+        elif content:
+            counts["accented"] += "caf\u00e9" in content
+            counts["replaced"] += "\ufffd" in content
+
+for name, count in counts.items():
+    assert count > 0, "no %s article" % name
+
+print("jsonl ok : %(articles)d articles, %(binary)d binary, %(replaced)d with invalid UTF-8" % counts)
+CHECK
@@ -1,6 +1,10 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "utils.h"
+
 /*
  * Safely allocates memory.
  */
@@ -33,3 +37,54 @@ xrealloc (void *mem, size_t msize)
   return mem;
 }
 
+/*
+ * Parse a size like `512M` into `size`, in bytes.
+ *
+ * Accepted suffixes are K, M and G (powers of 1024). Sizes must start with
+ * a digit, so negative ones are refused rather than wrapping around.
+ *
+ * Return non-zero if `str` is not a valid size, or doesn't fit in a size_t.
+ */
+int
+parse_size (const char *str, size_t *size)
+{
+  char *end = NULL;
+  int shift = 0;
+
+  if (*str < '0' || *str > '9')
+    return 1;
+
+  errno = 0;
+  unsigned long long int value = strtoull (str, &end, 10);
+  if (errno == ERANGE)
+    return 1;
+
+  switch (*end)
+    {
+      case 'G':
+      case 'g':
+        shift += 10;
+        // fall through
+      case 'M':
+      case 'm':
+        shift += 10;
+        // fall through
+      case 'K':
+      case 'k':
+        shift += 10;
+        end++;
+        break;
+
+      case 0:
+        break;
+
+      default:
+        return 1;
+    }
+
+  if (*end != 0 || value > SIZE_MAX >> shift)
+    return 1;
+
+  *size = value << shift;
+  return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
+
 /*
  * Safely allocates memory.
  */
@@ -11,4 +13,14 @@ void *xalloc (size_t len);
  */
 void *xrealloc (void *mem, size_t msize);
 
+/*
+ * Parse a size like `512M` into `size`, in bytes.
+ *
+ * Accepted suffixes are K, M and G (powers of 1024). Sizes must start with
+ * a digit, so negative ones are refused rather than wrapping around.
+ *
+ * Return non-zero if `str` is not a valid size, or doesn't fit in a size_t.
+ */
+int parse_size (const char *str, size_t *size);
+
 #endif
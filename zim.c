@@ -1,26 +1,55 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <lzma.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <zstd.h>
 
+#include "arena.h"
+#include "output.h"
+#include "queue.h"
+#include "stats.h"
 #include "utils.h"
 #include "zim.h"
 
+#define ZIM_MAGIC_NUMBER 72173914
+#define ZIM_HEADER_SIZE 80
 #define MAX_MIME_TYPES_LEN 10000
 #define COMPRESSION_XZ 4
 #define COMPRESSION_ZSTD 5
-#define MAX_ARTICLE_SIZE 10000000
 #define MIME_TYPE_REDIRECT 0xffff
 #define MIME_TYPE_REDLINK 0xfffe
 #define MIME_TYPE_DELETED 0xfffd
+#define PIPELINE_JOBS_PER_WORKER 64
+#define SCAN_CHUNK_SIZE (4 * 1024 * 1024)
+#define BATCH_WINDOW_SIZE 4096
+#define MAX_REDIRECTS 32
+#define REDIRECT_UNRESOLVED 0xFFFFFFFF
+#define ALL_BLOBS UINT_MAX
+#define BINARY_STREAM_MAGIC "ZIMDUMP\x01"
+#define BINARY_RECORD_HEADER_SIZE 36
+#define BINARY_FLAG_CONTENT 0x01
+#define BINARY_FLAG_NOT_WHITELISTED 0x02
+#define CHECKPOINT_INTERVAL 10
+#define ENTRY_ARENA_BLOCK_SIZE (64 * 1024)
+#define OFFSET_TABLES_COUNT 64
+#define OFFSET_TABLE_PREFIX_SIZE 4096
+#define STREAM_CHUNK_SIZE (256 * 1024)
+#define TRUSTED_COMPRESSION_RATIO 128
+#define SHARD_DECOMPRESSION_WEIGHT 4
 
 typedef struct {
   unsigned int magic_number;
   unsigned short int major_version;
   unsigned short int minor_version;
-  unsigned long long int uuid;
+  unsigned char uuid[16];
   unsigned int article_count;
   unsigned int cluster_count;
   unsigned long int url_ptr_pos;
@@ -39,12 +68,161 @@ typedef struct {
 } zim_mime_type_list_t;
 
 typedef struct {
+  unsigned int number;
+  size_t offset_size;
+  size_t len;
+  bool mapped;
+  const char *data;
+} zim_cluster_t;
+
+/*
+ * Decompression state of a cluster which is decompressed a part at a time,
+ * see read_cluster_stream().
+ *
+ * Compressed input is read from the mapping of the zimfile, or by chunks of
+ * up to STREAM_CHUNK_SIZE bytes in `copy` otherwise : `pending` bytes are
+ * left to read from `pos`.
+ */
+typedef struct {
+  const zim_archive_t *archive;
+  int compression;
+  char *copy;
+  size_t copy_len;
+  unsigned long int pos;
+  size_t pending;
+  lzma_stream xz;
+  ZSTD_DCtx *zstd;
+  ZSTD_inBuffer input;
+} zim_cluster_stream_t;
+
+/*
+ * `users` counts the callers of get_cluster() which did not release the
+ * cluster yet. A cluster is never evicted while in use.
+ *
+ * `loading` is true while a thread decompresses the cluster, other threads
+ * wanting it wait for it rather than decompressing it again.
+ *
+ * When `stream` is set, only the first `decoded` bytes of the cluster are
+ * there yet, see read_cluster_prefix(). Those never change, so they can
+ * be used while decompression goes on past them : `decoding` is true
+ * meanwhile, and only threads wanting blobs further than `decoded` wait.
+ * `size` is what the cluster counts for in the cache.
+ */
+typedef struct zim_cached_cluster_s {
+  zim_cluster_t cluster;
+  unsigned int users;
+  bool loading;
+  bool decoding;
+  size_t decoded;
+  zim_cluster_stream_t *stream;
+  size_t size;
+  struct zim_cached_cluster_s *newer;
+  struct zim_cached_cluster_s *older;
+} zim_cached_cluster_t;
+
+/*
+ * Blob offsets found at the start of a compressed cluster, `len` bytes of
+ * them. See read_blob_size().
+ */
+typedef struct {
+  unsigned int cluster_number;
+  size_t offset_size;
+  size_t len;
+  char *data;
+} zim_offset_table_t;
+
+/*
+ * Least recently used decompressed clusters, bounded by the sum of their
+ * decompressed sizes.
+ *
+ * `slots` is indexed by cluster number. Everything is protected by `lock`,
+ * except decompression itself.
+ *
+ * `loaded_once` has a bit set for each cluster which has been loaded at
+ * least once, to count distinct clusters with --stats.
+ *
+ * `offset_tables` keeps the offset tables of the last clusters whose blob
+ * sizes were needed without their content, at slot `cluster_number %
+ * OFFSET_TABLES_COUNT`.
+ */
+typedef struct {
+  size_t max_size;
+  size_t size;
+  size_t slots_len;
+  zim_cached_cluster_t **slots;
+  unsigned char *loaded_once;
+  zim_cached_cluster_t *newest;
+  zim_cached_cluster_t *oldest;
+  zim_offset_table_t offset_tables[OFFSET_TABLES_COUNT];
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+} zim_cluster_cache_t;
+
+/*
+ * Predicates on the fixed-size header of directory entries, compiled once
+ * by zim_parse(). `whitelisted` and `mime_types` are indexed by mime-type
+ * number and have `mime_types_count` items, `namespaces` is indexed by
+ * namespace.
+ *
+ * `whitelisted` tells which mime-types have their content printed, NULL
+ * meaning none. Entries are dumped when their mime-type is in `mime_types`
+ * (NULL for any) and their namespace in `namespaces`. When `min_size` or
+ * `max_size` is set, only entries with content of that size are, `max_size`
+ * being 0 for no limit.
+ */
+typedef struct {
+  size_t mime_types_count;
+  bool *whitelisted;
+  bool *mime_types;
+  bool namespaces[256];
+  size_t min_size;
+  size_t max_size;
+} zim_filter_t;
+
+/*
+ * `map` is NULL when the zimfile could not be mapped in memory, in which
+ * case it's read with pread() on `fd`.
+ *
+ * When `load_pointer_lists` is set before zim_parse(), the url and cluster
+ * pointer lists are decoded once in `url_ptrs` and `cluster_ptrs`, rather
+ * than read from the file for each lookup. `cluster_ptrs` has one more item
+ * than there are clusters : where the last one ends.
+ *
+ * When `resolve_redirects` is set before zim_parse(), `redirect_targets`
+ * tells where each entry ends up after following redirects, see
+ * resolve_redirects().
+ *
+ * When `partial_clusters` is set, clusters are only decompressed up to the
+ * blobs which are asked for, see get_cluster(). That's faster for lookups,
+ * while dumps need whole clusters anyway.
+ *
+ * When `options` is set before zim_parse(), its mime-type whitelist and
+ * entry filters are compiled in `filter`. Otherwise, every entry passes
+ * the filter and no content is whitelisted.
+ */
+struct zim_archive_s {
   char *path;
+  int fd;
+  size_t size;
+  const char *map;
   zim_header_t *header;
   zim_mime_type_list_t *mime_type_list;
-} zim_archive_t;
+  zim_cluster_cache_t *cluster_cache;
+  bool load_pointer_lists;
+  unsigned long int *url_ptrs;
+  unsigned long int *cluster_ptrs;
+  bool resolve_redirects;
+  unsigned int *redirect_targets;
+  bool partial_clusters;
+  const zim_dump_options_t *options;
+  zim_filter_t filter;
+};
 
+/*
+ * `index` is the position of the entry in the url pointer list.
+ */
 typedef struct {
+  size_t index;
   unsigned short int mime_type;
   char namespace;
   unsigned int revision;
@@ -55,249 +233,377 @@ typedef struct {
   char *title;
 } zim_directory_entry_t;
 
+typedef struct {
+  unsigned int cluster_number;
+  unsigned int blob_number;
+  unsigned int index;
+} zim_blob_ref_t;
+
 /*
- * Helper to decode a single integer, of `len` capacity, from the given
- * zimfile.
+ * Positions [start, end) in the url pointer list.
+ */
+typedef struct {
+  size_t start;
+  size_t end;
+} zim_range_t;
+
+/*
+ * Articles printed by dump_all_articles() : those at positions `range`
+ * which belong to the shard and pass `filter`. A shard holds the articles
+ * stored in clusters `clusters`, and the other ones (redirects, deleted
+ * pages) at positions `entries`. Without sharding, both cover the whole
+ * archive.
+ */
+typedef struct {
+  zim_range_t range;
+  zim_range_t clusters;
+  zim_range_t entries;
+  const zim_filter_t *filter;
+} zim_selection_t;
+
+/*
+ * Content of an article, as a view inside its cluster.
+ */
+typedef struct {
+  const zim_cluster_t *cluster;
+  const char *data;
+  size_t len;
+} zim_blob_t;
+
+
+/*
+ * Decode a single little-endian integer, of `len` capacity, from `buf`.
  *
- * Accepted values for `len` are 2, 4, 8 and 16 bytes. The result will be
+ * Accepted values for `len` are 2, 4 and 8 bytes. The result will be
  * placed in `dest`, which should be respectively a pointer to an unsigned
- * short int, an unsigned int, an unsigned long int and an unsigned long long
- * int.
+ * short int, an unsigned int and an unsigned long int.
  *
  * Return non-zero in case of error.
  * 
  */
 static int
-read_int (FILE *file, size_t len, void *dest)
+read_int_from_buf (const char *buf, size_t len, void *dest)
 {
-  int err = 0;
-  void *buf = xalloc (len);
-  size_t r = fread (buf, 1, len, file);
-  if (r != len)
-    {
-      err = 1;
-      fprintf (stderr, "zim.c : read_int() : could not read value from zimfile.\n");
-      goto cleanup;
-    }
+  const unsigned char *bytes = (const unsigned char *) buf;
+  unsigned long int value = 0;
+
+  for (size_t i = len; i > 0; i--)
+    value = (value << 8) | bytes[i - 1];
 
   switch (len)
     {
       case 2:
-        *(unsigned short int *) dest = *(unsigned short int *) buf;
+        *(unsigned short int *) dest = value;
         break;
 
       case 4:
-        *(unsigned int *) dest = *(unsigned int *) buf;
+        *(unsigned int *) dest = value;
         break;
 
       case 8:
-        *(unsigned long int *) dest = *(unsigned long int *) buf;
-        break;
-
-      case 16:
-        *(unsigned long long int *) dest = *(unsigned long long int *) buf;
+        *(unsigned long int *) dest = value;
         break;
 
       default:
-        err = 1;
-        fprintf (stderr, "zim.c : read_int() : unrecognized length for int : %ld.\n", len);
-        goto cleanup;
+        fprintf (stderr, "zim.c : read_int_from_buf() : unrecognized length for int : %ld.\n", len);
+        return 1;
     }
 
-  cleanup:
-  if (buf) free (buf);
-  return err;
+  return 0;
 }
 
 /*
- * Same as read_int(), but reading from a buffer rather than a file.
- * Used to read compressed data.
- *
- * Return non-zero in case of error.
- * 
+ * Write `value` as a little-endian int of `len` bytes in `buf`.
  */
-static int
-read_int_from_buf (const char *buf, size_t len, void *dest)
+static void
+write_int_to_buf (char *buf, size_t len, unsigned long int value)
 {
-  int err = 0;
-  char *tmp = xalloc (len);
   for (size_t i = 0; i < len; i++)
-    tmp[i] = buf[i];
-
-  switch (len)
     {
-      case 2:
-        *(unsigned short int *) dest = *(unsigned short int *) tmp;
-        break;
-
-      case 4:
-        *(unsigned int *) dest = *(unsigned int *) tmp;
-        break;
-
-      case 8:
-        *(unsigned long int *) dest = *(unsigned long int *) tmp;
-        break;
-
-      case 16:
-        *(unsigned long long int *) dest = *(unsigned long long int *) tmp;
-        break;
-
-      default:
-        err = 1;
-        fprintf (stderr, "zim.c : read_int_from_buf() : unrecognized length for int : %ld.\n", len);
-        goto cleanup;
+      buf[i] = value & 0xFF;
+      value >>= 8;
     }
-
-  cleanup:
-  if (tmp) free (tmp);
-  return err;
 }
 
 /*
- * Parse the header of the zimfile, containing metadata and position
- * of important blocks.
+ * Copy `len` bytes found at `pos` in the zimfile into `dest`.
  *
- * Return non-zero on error.
+ * They're read from the memory mapping of the archive if there is one, or
+ * with pread() otherwise.
+ *
+ * Return non-zero in case of error.
  */
 static int
-parse_headers (zim_header_t *header, FILE *file)
+read_at (const zim_archive_t *archive, unsigned long int pos, size_t len, void *dest)
 {
-  int err = read_int (file, 2, &(header->major_version));
-  if (err)
+  if (pos > archive->size || len > archive->size - pos)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read major version.\n");
+      fprintf (stderr, "zim.c : read_at() : corrupted zimfile : trying to read after end of file.\n");
       return 1;
     }
 
-  err = read_int (file, 2, &(header->minor_version));
-  if (err)
-    {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read minor version.\n");
-      return 1;
-    }
+  stats_count (STATS_BYTES_READ, len);
 
-  err = read_int (file, 16, &(header->uuid));
-  if (err)
+  if (archive->map)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read uuid.\n");
-      return 1;
+      memcpy (dest, archive->map + pos, len);
+      return 0;
     }
 
-  err = read_int (file, 4, &(header->article_count));
-  if (err)
+  size_t done = 0;
+  while (done < len)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read article count.\n");
-      return 1;
+      ssize_t r = pread (archive->fd, (char *) dest + done, len - done, pos + done);
+      if (r == -1 && errno == EINTR)
+        continue;
+
+      if (r <= 0)
+        {
+          fprintf (stderr, "zim.c : read_at() : can't read zimfile : %s\n", r == 0 ? "unexpected end of file" : strerror (errno));
+          return 1;
+        }
+
+      done += r;
     }
 
-  err = read_int (file, 4, &(header->cluster_count));
-  if (err)
+  return 0;
+}
+
+/*
+ * Get a view on `len` bytes found at `pos` in the zimfile.
+ *
+ * When the archive is mapped, this points directly into the mapping.
+ * Otherwise, the bytes are read in a new buffer, which `copy` is set to and
+ * which must be freed by caller. `copy` is set to NULL in the first case.
+ *
+ * Return NULL in case of error.
+ */
+static const char *
+view_at (const zim_archive_t *archive, unsigned long int pos, size_t len, char **copy)
+{
+  *copy = NULL;
+
+  if (pos > archive->size || len > archive->size - pos)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read cluster count.\n");
-      return 1;
+      fprintf (stderr, "zim.c : view_at() : corrupted zimfile : trying to read after end of file.\n");
+      return NULL;
     }
 
-  err = read_int (file, 8, &(header->url_ptr_pos));
-  if (err)
+  if (archive->map)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read url pointer position.\n");
-      return 1;
+      stats_count (STATS_BYTES_READ, len);
+      return archive->map + pos;
     }
 
-  err = read_int (file, 8, &(header->title_ptr_pos));
-  if (err)
+  *copy = xalloc (len ? len : 1);
+  if (read_at (archive, pos, len, *copy))
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read title pointer position.\n");
-      return 1;
+      free (*copy);
+      *copy = NULL;
+      return NULL;
     }
 
-  err = read_int (file, 8, &(header->cluster_ptr_pos));
-  if (err)
+  return *copy;
+}
+
+/*
+ * Helper to decode a single integer, of `len` capacity, found at `pos` in the
+ * zimfile.
+ *
+ * See read_int_from_buf() for accepted values of `len` and `dest`.
+ *
+ * Return non-zero in case of error.
+ * 
+ */
+static int
+read_int (const zim_archive_t *archive, unsigned long int pos, size_t len, void *dest)
+{
+  char buf[8];
+
+  if (len > sizeof (buf))
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read cluster pointer position.\n");
+      fprintf (stderr, "zim.c : read_int() : unrecognized length for int : %ld.\n", len);
       return 1;
     }
 
-  err = read_int (file, 8, &(header->mime_list_pos));
-  if (err)
+  if (read_at (archive, pos, len, buf))
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read mime list position.\n");
+      fprintf (stderr, "zim.c : read_int() : could not read value from zimfile.\n");
       return 1;
     }
 
-  err = read_int (file, 4, &(header->main_page));
-  if (err)
+  return read_int_from_buf (buf, len, dest);
+}
+
+/*
+ * Get room for a string of `len` characters and its NUL terminator, from
+ * `arena`, or with malloc() if it's NULL.
+ */
+static char *
+alloc_string (arena_t *arena, size_t len)
+{
+  return arena ? arena_alloc (arena, len + 1) : xrealloc (NULL, len + 1);
+}
+
+/*
+ * Read the NUL terminated string found at `pos` in the zimfile, whatever
+ * its length. It's allocated with alloc_string(). `consumed` is set to its
+ * size in the zimfile, including its NUL terminator.
+ *
+ * Return NULL in case of error.
+ */
+static char *
+read_string_at (const zim_archive_t *archive, unsigned long int pos, arena_t *arena, size_t *consumed)
+{
+  if (archive->map)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read main page position.\n");
-      return 1;
+      if (pos >= archive->size)
+        {
+          fprintf (stderr, "zim.c : read_string_at() : corrupted zimfile : trying to read after end of file.\n");
+          return NULL;
+        }
+
+      const char *start = archive->map + pos;
+      const char *end = memchr (start, 0, archive->size - pos);
+      if (!end)
+        {
+          fprintf (stderr, "zim.c : read_string_at() : corrupted zimfile : unterminated string.\n");
+          return NULL;
+        }
+
+      size_t len = end - start;
+      char *str = alloc_string (arena, len);
+      memcpy (str, start, len + 1);
+      *consumed = len + 1;
+
+      return str;
     }
 
-  err = read_int (file, 4, &(header->layout_page));
-  if (err)
+  char chunk[256];
+  char *buf = NULL;
+  size_t len = 0;
+
+  while (true)
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read layout page position.\n");
-      return 1;
+      size_t chunk_len = sizeof (chunk);
+      if (pos + len >= archive->size)
+        {
+          fprintf (stderr, "zim.c : read_string_at() : corrupted zimfile : unterminated string.\n");
+          free (buf);
+          return NULL;
+        }
+
+      if (archive->size - pos - len < chunk_len)
+        chunk_len = archive->size - pos - len;
+
+      if (read_at (archive, pos + len, chunk_len, chunk))
+        {
+          free (buf);
+          return NULL;
+        }
+
+      const char *end = memchr (chunk, 0, chunk_len);
+      size_t found = end ? (size_t) (end - chunk) : chunk_len;
+
+      buf = xrealloc (buf, len + found + 1);
+      memcpy (buf + len, chunk, found);
+      len += found;
+      if (end) break;
     }
 
-  err = read_int (file, 4, &(header->checksum_pos));
-  if (err)
+  buf[len] = 0;
+  *consumed = len + 1;
+
+  if (!arena)
+    return buf;
+
+  char *str = alloc_string (arena, len);
+  memcpy (str, buf, len + 1);
+  free (buf);
+  return str;
+}
+
+/*
+ * Parse the header of the zimfile, containing metadata and position
+ * of important blocks.
+ *
+ * Return non-zero on error.
+ */
+static int
+parse_headers (const zim_archive_t *archive)
+{
+  zim_header_t *header = archive->header;
+  char buf[ZIM_HEADER_SIZE];
+
+  if (read_at (archive, 0, sizeof (buf), buf))
     {
-      fprintf (stderr, "zim.c : parse_headers() : malformed headers : can't read checksum position.\n");
+      fprintf (stderr, "zim.c : parse_headers() : malformed headers : file is too small.\n");
       return 1;
     }
 
+  read_int_from_buf (buf, 4, &header->magic_number);
+  read_int_from_buf (buf + 4, 2, &header->major_version);
+  read_int_from_buf (buf + 6, 2, &header->minor_version);
+  memcpy (header->uuid, buf + 8, sizeof (header->uuid));
+  read_int_from_buf (buf + 24, 4, &header->article_count);
+  read_int_from_buf (buf + 28, 4, &header->cluster_count);
+  read_int_from_buf (buf + 32, 8, &header->url_ptr_pos);
+  read_int_from_buf (buf + 40, 8, &header->title_ptr_pos);
+  read_int_from_buf (buf + 48, 8, &header->cluster_ptr_pos);
+  read_int_from_buf (buf + 56, 8, &header->mime_list_pos);
+  read_int_from_buf (buf + 64, 4, &header->main_page);
+  read_int_from_buf (buf + 68, 4, &header->layout_page);
+  read_int_from_buf (buf + 72, 8, &header->checksum_pos);
+
   return 0;
 }
 
 /*
  * Find the list of mime-types in the archive, and populate
  * archive->mime_type_list.
+ *
+ * Return non-zero in case of error.
  */
-static void
-parse_mime_type_list (const zim_archive_t *archive, FILE *file)
+static int
+parse_mime_type_list (const zim_archive_t *archive)
 {
-  int continue_parsing = 1;
   zim_mime_type_list_t *list = archive->mime_type_list;
-  fseek (file, archive->header->mime_list_pos, SEEK_SET);
+  unsigned long int pos = archive->header->mime_list_pos;
 
-  while (continue_parsing)
+  while (true)
     {
-      char *buf = xalloc (101);
-      size_t pos = 0;
-      while (pos < 100)
-        {
-          int r = fread (buf + pos, 1, 1, file);
-          if (r != 1)
-            {
-              fprintf (stderr, "parse_mime_type_list() : can't read file.\n");
-              exit (1);
-            }
-
-          if (buf[pos] == 0)
-            break;
+      size_t consumed = 0;
+      char *buf = read_string_at (archive, pos, NULL, &consumed);
 
-          pos++;
+      if (!buf)
+        {
+          fprintf (stderr, "zim.c : parse_mime_type_list() : can't read mime-type.\n");
+          return 1;
         }
 
-      if (strncmp (buf, "", 100) == 0)
+      pos += consumed;
+
+      if (buf[0] == 0)
         {
-          continue_parsing = 0;
           free (buf);
+          break;
         }
-      else
-        {
-          list->len++;
 
-          if (list->len > MAX_MIME_TYPES_LEN)
-            {
-              fprintf (stderr, "zim.c : parse_mime_type_list() : maximum number of header exceeded, ignoring the rest.\n");
-              return;
-            }
+      list->len++;
 
-          list->items = xrealloc (list->items, list->len * sizeof (char *));
-          list->items[list->len - 1] = buf;
+      if (list->len > MAX_MIME_TYPES_LEN)
+        {
+          fprintf (stderr, "zim.c : parse_mime_type_list() : maximum number of header exceeded, ignoring the rest.\n");
+          list->len--;
+          free (buf);
+          break;
         }
+
+      list->items = xrealloc (list->items, list->len * sizeof (char *));
+      list->items[list->len - 1] = buf;
     }
+
+  return 0;
 }
 
 static zim_archive_t *
@@ -306,7 +612,11 @@ new_zim_archive ()
   zim_archive_t *archive = xalloc (sizeof (*archive));
   archive->header = xalloc (sizeof (*archive->header));
   archive->mime_type_list = xalloc (sizeof (*archive->mime_type_list));
+  archive->cluster_cache = xalloc (sizeof (*archive->cluster_cache));
+  pthread_mutex_init (&archive->cluster_cache->lock, NULL);
+  pthread_cond_init (&archive->cluster_cache->loaded, NULL);
   archive->path = NULL;
+  archive->fd = -1;
 
   return archive;
 }
@@ -326,6 +636,50 @@ free_zim_mime_type_list (zim_mime_type_list_t *list)
   free (list);
 }
 
+static void
+free_zim_cluster_content (zim_cluster_t *cluster)
+{
+  if (cluster->data && !cluster->mapped) free ((void *) cluster->data);
+  cluster->data = NULL;
+  cluster->len = 0;
+}
+
+static void
+free_cluster_stream (zim_cluster_stream_t *stream)
+{
+  if (!stream) return;
+
+  if (stream->compression == COMPRESSION_XZ) lzma_end (&stream->xz);
+  if (stream->zstd) ZSTD_freeDCtx (stream->zstd);
+  if (stream->copy) free (stream->copy);
+  free (stream);
+}
+
+static void
+free_zim_cluster_cache (zim_cluster_cache_t *cache)
+{
+  if (!cache) return;
+
+  zim_cached_cluster_t *cached = cache->newest;
+  while (cached)
+    {
+      zim_cached_cluster_t *older = cached->older;
+      free_zim_cluster_content (&cached->cluster);
+      free_cluster_stream (cached->stream);
+      free (cached);
+      cached = older;
+    }
+
+  for (size_t i = 0; i < OFFSET_TABLES_COUNT; i++)
+    if (cache->offset_tables[i].data) free (cache->offset_tables[i].data);
+
+  if (cache->slots) free (cache->slots);
+  if (cache->loaded_once) free (cache->loaded_once);
+  pthread_mutex_destroy (&cache->lock);
+  pthread_cond_destroy (&cache->loaded);
+  free (cache);
+}
+
 static void
 free_zim_archive (zim_archive_t *archive)
 {
@@ -333,11 +687,22 @@ free_zim_archive (zim_archive_t *archive)
 
   if (archive->header) free (archive->header);
   if (archive->mime_type_list) free_zim_mime_type_list (archive->mime_type_list);
+  if (archive->cluster_cache) free_zim_cluster_cache (archive->cluster_cache);
   if (archive->path) free (archive->path);
+  if (archive->url_ptrs) free (archive->url_ptrs);
+  if (archive->cluster_ptrs) free (archive->cluster_ptrs);
+  if (archive->redirect_targets) free (archive->redirect_targets);
+  if (archive->filter.whitelisted) free (archive->filter.whitelisted);
+  if (archive->filter.mime_types) free (archive->filter.mime_types);
+  if (archive->map) munmap ((void *) archive->map, archive->size);
+  if (archive->fd != -1) close (archive->fd);
 
   free (archive);
 }
 
+/*
+ * Free an entry read without an arena.
+ */
 static void
 free_zim_directory_entry (zim_directory_entry_t *entry)
 {
@@ -350,757 +715,3830 @@ free_zim_directory_entry (zim_directory_entry_t *entry)
 }
 
 /*
- * Read an entry in the index table. This is where url and title resides, plus
- * address of full content.
- *
- * You must allocate memory for `entry`.
- *
- * Return non-zero in case of error.
+ * Get a zeroed entry from `arena`, or from the heap if it's NULL.
  */
-static int
-parse_directory_entry (FILE *file, zim_directory_entry_t *entry)
+static zim_directory_entry_t *
+new_zim_directory_entry (arena_t *arena)
 {
-  int err = 0;
-  int r = 0;
+  if (!arena)
+    return xalloc (sizeof (zim_directory_entry_t));
 
-  err = read_int (file, 2, &entry->mime_type);
-  if (err)
-    {
-      fprintf (stderr, "zim.c : parse_directory_entry() : malformed zimfile : can't read entry mime type.\n");
-      goto cleanup;
-    }
+  zim_directory_entry_t *entry = arena_alloc (arena, sizeof (*entry));
+  *entry = (zim_directory_entry_t) { 0 };
+  return entry;
+}
 
-  if (fseek (file, 1, SEEK_CUR) == -1)
-    {
-      err = 1;
-      fprintf (stderr, "zim.c : parse_directory_entry() : can't access file anymore.\n");
-      goto cleanup;
-    }
-
-  r = fread (&entry->namespace, 1, 1, file);
-  if (r != 1)
+/*
+ * Forget url and title of `entry` before reading another entry in it. They
+ * are freed unless they come from `arena`.
+ */
+static void
+clear_zim_directory_entry (zim_directory_entry_t *entry, const arena_t *arena)
+{
+  if (!arena)
     {
-      err = 1;
-      fprintf (stderr, "zim.c : parse_directory_entry() : can't read file anymore.\n");
-      goto cleanup;
+      free (entry->url);
+      free (entry->title);
     }
 
-  err = read_int (file, 4, &entry->revision);
-  if (err)
+  entry->url = entry->title = NULL;
+}
+
+/*
+ * Read the fixed-size header of the directory entry found at `pos` in the
+ * zimfile : everything but url and title. `pos` is moved to where the url
+ * starts.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+parse_directory_entry_header (const zim_archive_t *archive, unsigned long int *pos, zim_directory_entry_t *entry)
+{
+  char buf[16];
+
+  if (read_at (archive, *pos, 12, buf))
     {
-      fprintf (stderr, "zim.c : parse_directory_entry() : malformed zimfile : can't read revision.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : parse_directory_entry_header() : malformed zimfile : can't read entry.\n");
+      return 1;
     }
 
+  read_int_from_buf (buf, 2, &entry->mime_type);
+  entry->namespace = buf[3];
+  read_int_from_buf (buf + 4, 4, &entry->revision);
+
   if (entry->mime_type == MIME_TYPE_REDIRECT)
     {
-      err = read_int (file, 4, &entry->redirect_index);
-      if (err)
-        {
-          fprintf (stderr, "zim.c : parse_directory_entry() : malformed zimfile : can't read redirect index.\n");
-          goto cleanup;
-        }
+      read_int_from_buf (buf + 8, 4, &entry->redirect_index);
+      *pos += 12;
     }
   else
     {
-      err = read_int (file, 4, &entry->cluster_number);
-      if (err)
-        {
-          fprintf (stderr, "zim.c : parse_directory_entry() : malformed zimfile : can't read cluster number.\n");
-          goto cleanup;
-        }
-
-      err = read_int (file, 4, &entry->blob_number);
-      if (err)
+      read_int_from_buf (buf + 8, 4, &entry->cluster_number);
+      if (read_int (archive, *pos + 12, 4, &entry->blob_number))
         {
-          fprintf (stderr, "zim.c : parse_directory_entry() : malformed zimfile : can't read blob number.\n");
-          goto cleanup;
+          fprintf (stderr, "zim.c : parse_directory_entry_header() : malformed zimfile : can't read blob number.\n");
+          return 1;
         }
+      *pos += 16;
     }
 
-  entry->url = xalloc (1001);
-  entry->title = xalloc (1001);
+  return 0;
+}
 
-  for (size_t i = 0; i < 1000; i++)
-    {
-      char c;
-      size_t read = fread (&c, 1, 1, file);
-      if (read < 1)
-        {
-          err = 1;
-          fprintf (stderr, "zim.c : parse_directory_entry() : can't read url from file\n");
-          goto cleanup;
-        }
+/*
+ * Read url and title of a directory entry, starting at `pos`, see
+ * parse_directory_entry_header().
+ *
+ * Return non-zero in case of error.
+ */
+static int
+parse_directory_entry_strings (const zim_archive_t *archive, unsigned long int pos, zim_directory_entry_t *entry, arena_t *arena)
+{
+  size_t consumed = 0;
 
-      entry->url[i] = c;
-      if (c == 0) break;
+  entry->url = read_string_at (archive, pos, arena, &consumed);
+  if (!entry->url)
+    {
+      fprintf (stderr, "zim.c : parse_directory_entry_strings() : can't read url from file\n");
+      return 1;
     }
-  entry->url[1000] = 0;
 
-  for (size_t i = 0; i < 1000; i++)
+  entry->title = read_string_at (archive, pos + consumed, arena, &consumed);
+  if (!entry->title)
     {
-      char c;
-      size_t read = fread (&c, 1, 1, file);
-      if (read < 1)
-        {
-          err = 1;
-          fprintf (stderr, "zim.c : parse_directory_entry() : can't read title from file\n");
-          goto cleanup;
-        }
-      entry->title[i] = c;
-      if (c == 0) break;
+      fprintf (stderr, "zim.c : parse_directory_entry_strings() : can't read title from file\n");
+      return 1;
     }
-  entry->title[1000] = 0;
 
-  cleanup:
-  return err;
+  return 0;
 }
 
 /*
- * Parse the zimfile at `path` into `archive`.
- *
- * This will fill the header information so the rest of the content can be
- * reached.
+ * Read an entry in the index table, found at `pos` in the zimfile. This is
+ * where url and title resides, plus address of full content.
  *
- * You must allocate memory for `archive`.
+ * You must allocate memory for `entry`. Url and title are allocated from
+ * `arena`, or on the heap if it's NULL, see read_string_at().
  *
  * Return non-zero in case of error.
  */
 static int
-zim_parse (const char *path, zim_archive_t *archive)
+parse_directory_entry (const zim_archive_t *archive, unsigned long int pos, zim_directory_entry_t *entry, arena_t *arena)
 {
-  int err = 0;
-  void *buf = NULL;
-  unsigned int magic_number = 0;
-  FILE *file = NULL;
+  if (parse_directory_entry_header (archive, &pos, entry))
+    return 1;
 
+  return parse_directory_entry_strings (archive, pos, entry, arena);
+}
 
-  file = fopen (path, "r");
-  if (!file)
+/*
+ * Find where the entry at position `i` in the url pointer list is stored.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_url_pointer (const zim_archive_t *archive, size_t i, unsigned long int *pos)
+{
+  if (i >= archive->header->article_count)
     {
-      err = 1;
-      fprintf (stderr, "zim.c : zim_parse() : can't open file : %s\n", path);
-      goto cleanup;
+      fprintf (stderr, "zim.c : read_url_pointer() : there is no entry %zu.\n", i);
+      return 1;
     }
 
-  buf = xalloc (4);
-  size_t r = fread (buf, 1, 4, file);
-  if (r != 4)
+  if (archive->url_ptrs)
+    *pos = archive->url_ptrs[i];
+  else if (read_int (archive, archive->header->url_ptr_pos + i * 8, 8, pos))
     {
-      err = 1;
-      fprintf (stderr, "zim.c : zim_parse() : error while reading file : %s\n", path);
-      goto cleanup;
+      fprintf (stderr, "zim.c : read_url_pointer() : can't read url pointer.\n");
+      return 1;
     }
 
-  magic_number = *(unsigned int *) buf;
-  if (magic_number != 72173914)
-    {
-      err = 1;
-      fprintf (stderr, "zim.c : zim_parse() : the magic number for this file does not match the one expected. This means it's either not a zimfile, or it's an incompatible version of one.\n");
-      goto cleanup;
-    }
+  return 0;
+}
 
-  archive->header->magic_number = magic_number;
-  archive->path = strdup (path);
+/*
+ * Read the entry at position `i` in the url pointer list.
+ *
+ * You must allocate memory for `entry`. See parse_directory_entry() for
+ * `arena`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_directory_entry_at_index (const zim_archive_t *archive, size_t i, zim_directory_entry_t *entry, arena_t *arena)
+{
+  unsigned long int dir_entry = 0;
 
-  err = parse_headers (archive->header, file);
-  if (err)
+  if (read_url_pointer (archive, i, &dir_entry))
+    return 1;
+
+  unsigned long long int started = stats_start ();
+  entry->index = i;
+  int err = parse_directory_entry (archive, dir_entry, entry, arena);
+  stats_end (STATS_DIRECTORY, started);
+  stats_count (STATS_ENTRIES, 1);
+
+  return err;
+}
+
+/*
+ * Open the zimfile at `path`, mapping it in memory when possible.
+ *
+ * Mapping is skipped on 32 bits systems, where address space is too small
+ * for big archives. pread() is used instead.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+open_archive_file (const char *path, zim_archive_t *archive)
+{
+  struct stat st;
+
+  archive->fd = open (path, O_RDONLY);
+  if (archive->fd == -1)
     {
-      fprintf (stderr, "zim.c : zim_parse() : error while reading headers.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : open_archive_file() : can't open file : %s\n", path);
+      return 1;
     }
 
-  parse_mime_type_list (archive, file);
-
-  if (fseek (file, archive->header->url_ptr_pos, SEEK_SET) == -1)
+  if (fstat (archive->fd, &st) == -1)
     {
-      err = 1;
-      fprintf (stderr, "zim.c : zim_parse() :corrupted  zimfile : can't jump to url pointer position.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : open_archive_file() : can't stat file : %s\n", path);
+      return 1;
     }
 
-  err = read_int (file, 8, &archive->header->dir_entries_pos);
-  if (err)
+  archive->size = st.st_size;
+
+  if (sizeof (void *) >= 8 && archive->size > 0)
     {
-      fprintf (stderr, "zim.c : zim_parse() :corrupted  zimfile : can't read dir entries position.\n");
-      goto cleanup;
+      void *map = mmap (NULL, archive->size, PROT_READ, MAP_SHARED, archive->fd, 0);
+      if (map != MAP_FAILED)
+        archive->map = map;
     }
 
-  cleanup:
-  if (file) fclose (file);
-  if (buf) free (buf);
-  return err;
+  return 0;
 }
 
 /*
- * LZMA setup.
+ * Read a list of `count` 8 bytes positions at `pos` in a single read, and
+ * decode it in `list`.
+ *
+ * You must allocate memory for `list`.
  *
  * Return non-zero in case of error.
  */
 static int
-init_lzma_decoder (lzma_stream *strm)
+read_pointer_list (const zim_archive_t *archive, unsigned long int pos, size_t count, unsigned long int *list)
 {
-  int err = 0;
-	lzma_ret ret = lzma_stream_decoder (strm, UINT64_MAX, 0);
+  char *copy = NULL;
+  const char *raw = view_at (archive, pos, count * 8, &copy);
+  if (!raw)
+    return 1;
 
-	if (ret != LZMA_OK)
-    {
-      err = 1;
-      const char *msg;
+  for (size_t i = 0; i < count; i++)
+    read_int_from_buf (raw + i * 8, 8, &list[i]);
 
-      switch (ret)
-      {
-        case LZMA_MEM_ERROR:
-          msg = "Memory allocation failed";
-          break;
+  if (copy) free (copy);
+  return 0;
+}
 
-        case LZMA_OPTIONS_ERROR:
-          msg = "Unsupported decompressor flags";
-          break;
+/*
+ * Load the url and cluster pointer lists in memory.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+load_pointer_lists (zim_archive_t *archive)
+{
+  zim_header_t *header = archive->header;
 
-        default:
-          msg = "Unknown error, possibly a bug";
-          break;
-      }
+  archive->url_ptrs = xalloc ((header->article_count + 1) * sizeof (*archive->url_ptrs));
+  if (read_pointer_list (archive, header->url_ptr_pos, header->article_count, archive->url_ptrs))
+    {
+      fprintf (stderr, "zim.c : load_pointer_lists() : corrupted zimfile : can't read url pointer list.\n");
+      return 1;
+    }
 
-      fprintf(stderr, "Error initializing the lzma decoder: %s (error code %u)\n", msg, ret);
+  archive->cluster_ptrs = xalloc ((header->cluster_count + 1) * sizeof (*archive->cluster_ptrs));
+  if (read_pointer_list (archive, header->cluster_ptr_pos, header->cluster_count, archive->cluster_ptrs))
+    {
+      fprintf (stderr, "zim.c : load_pointer_lists() : corrupted zimfile : can't read cluster pointer list.\n");
+      return 1;
     }
+  archive->cluster_ptrs[header->cluster_count] = header->checksum_pos;
 
-	return err;
+  return 0;
 }
 
 /*
- * Read data or `len` length from a XZ compressed cluster.
+ * Build `archive->redirect_targets` : for each entry, the position in the
+ * url pointer list of the entry it ends up at once redirects are followed,
+ * which is itself for entries that are not redirects. Redirects which lead
+ * to a cycle or to a missing entry are set to REDIRECT_UNRESOLVED.
  *
- * `file`'s read pointer should be positioned at the start of
- * the data.
+ * Only headers of entries are read, once each. Chains are then collapsed in
+ * memory : each redirect is walked once to find where it ends, marking
+ * the entries on its way, and once more to point them all there. Running
+ * into a marked entry means the chain loops.
  *
  * Return non-zero in case of error.
  */
 static int
-read_from_xz_compressed_cluster (FILE *file, size_t start, size_t len, void *buf)
+resolve_redirects (zim_archive_t *archive)
 {
-  int err = 0;
-	lzma_stream strm = LZMA_STREAM_INIT;
-	lzma_action action = LZMA_RUN;
-	uint8_t inbuf[BUFSIZ];
-	uint8_t outbuf[BUFSIZ];
-  size_t read_count = 0;
-  size_t buf_pos = 0;
-
-  err = init_lzma_decoder (&strm);
-  if (err)
-    {
-      fprintf (stderr, "zim.c : read_from_xz_compressed_cluster() : can't initialize lzma.\n");
-      goto cleanup;
-    }
-
-	strm.next_in = NULL;
-	strm.avail_in = 0;
-	strm.next_out = outbuf;
-	strm.avail_out = sizeof(outbuf);
+  enum { RESOLVED, PENDING, VISITING };
+  size_t count = archive->header->article_count;
+  unsigned int *targets = xalloc ((count + 1) * sizeof (*targets));
+  unsigned char *states = xalloc (count + 1);
 
-	while (true)
+  unsigned long long int started = stats_start ();
+  for (size_t i = 0; i < count; i++)
     {
-      if (strm.avail_in == 0 && !feof (file))
-        {
-          strm.next_in = inbuf;
-          strm.avail_in = fread (inbuf, 1, sizeof (inbuf), file);
-
-          if (ferror (file))
-            {
-              err = 1;
-              fprintf (stderr, "zim.c : read_from_xz_compressed_cluster() : Read error: %s\n", strerror (errno));
-              goto cleanup;
-            }
+      zim_directory_entry_t entry = { 0 };
+      unsigned long int pos = 0;
 
-          if (feof (file))
-            action = LZMA_FINISH;
+      if (read_url_pointer (archive, i, &pos) || parse_directory_entry_header (archive, &pos, &entry))
+        {
+          fprintf (stderr, "zim.c : resolve_redirects() : bogus entry found. Ignoring.\n");
+          entry.mime_type = MIME_TYPE_DELETED;
         }
 
-      lzma_ret ret = lzma_code (&strm, action);
-
-      if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
-        size_t write_size = sizeof (outbuf) - strm.avail_out;
-        uint8_t *outbuf_reader = outbuf;
+      targets[i] = entry.mime_type == MIME_TYPE_REDIRECT ? entry.redirect_index : i;
+      states[i] = entry.mime_type == MIME_TYPE_REDIRECT ? PENDING : RESOLVED;
+    }
+  stats_end (STATS_DIRECTORY, started);
+  stats_count (STATS_REDIRECT_SCAN, count);
 
-        if (read_count < start)
-          {
-            if (read_count + write_size >= start)
-              {
-                size_t offset = start - read_count;
-                outbuf_reader += offset;
-                write_size -= offset;
-              }
-            else
-              goto writing_done;
-          }
-
-        char *tmp_buf = buf;
-        tmp_buf += buf_pos;
-
-        size_t should_write = write_size;
-        if (buf_pos + write_size >= len)
-          should_write = len - buf_pos;
-        memcpy ((void *) tmp_buf, outbuf_reader, should_write);
-        buf_pos += should_write;
-        if (buf_pos >= len) return true; // all is read
-
-        writing_done:
-        read_count += BUFSIZ;
-        strm.next_out = outbuf;
-        strm.avail_out = sizeof (outbuf);
-      }
+  for (size_t i = 0; i < count; i++)
+    {
+      unsigned int target = REDIRECT_UNRESOLVED;
+      size_t j = i;
 
-      if (ret != LZMA_OK)
+      while (j < count && states[j] == PENDING)
         {
-          if (ret == LZMA_STREAM_END)
-            {
-              fprintf(stderr, "End of archive reached before expected length\n");
-              return false;
-            }
+          states[j] = VISITING;
+          j = targets[j];
+        }
 
-          const char *msg;
-          switch (ret)
-            {
-              case LZMA_MEM_ERROR:
-                msg = "Memory allocation failed";
-                break;
-
-              case LZMA_FORMAT_ERROR:
-                msg = "The input is not in the .xz format";
-                break;
-
-              case LZMA_OPTIONS_ERROR:
-                msg = "Unsupported compression options";
-                break;
-
-              case LZMA_DATA_ERROR:
-                msg = "Compressed file is corrupt";
-                break;
-
-              case LZMA_BUF_ERROR:
-                msg = "Compressed file is truncated or "
-                    "otherwise corrupt";
-                break;
-
-              default:
-                msg = "Unknown error, possibly a bug";
-                break;
-            }
+      if (j < count && states[j] == RESOLVED)
+        target = targets[j];
 
-          fprintf (stderr, "zim.c : read_from_xz_compressed_cluster() : Decoder error: " "%s (error code %u)\n", msg, ret);
-          return false;
+      for (j = i; j < count && states[j] == VISITING; )
+        {
+          size_t next = targets[j];
+          targets[j] = target;
+          states[j] = RESOLVED;
+          j = next;
         }
     }
 
-  cleanup:
-  return err;
+  free (states);
+  archive->redirect_targets = targets;
+  return 0;
 }
 
 /*
- * Read a whole article from a XZ compressed cluster.
- *
- * The position of the cluster is retrieved from the provided `entry`.
- *
- * Return NULL in case of error.
+ * Utility to find if a given mime-type is accepted by the comma seperated
+ * whitelist provided as option or by default.
  */
-static char *
-read_article_from_xz_compressed_cluster (const zim_directory_entry_t *entry, FILE *file, size_t offset_size)
+static bool
+is_accepted_mimetype (const char *mime_type, const char *mime_type_whitelist)
 {
-  char *content = NULL;
-  long initial_pos = ftell (file);
+  const char *accepted_mime_type = mime_type_whitelist;
 
-  unsigned long int blob_index_pos = offset_size * entry->blob_number;
-  unsigned long int blob_index = 0;
-  int err = read_from_xz_compressed_cluster (file, blob_index_pos, offset_size, &blob_index);
-  if (err)
+  while (*accepted_mime_type)
     {
-      fprintf (stderr, "zim.c : read_article_from_compressed_cluster() : can't find blob start position\n");
-      return strdup ("Error reading article.");
-    }
-  fseek (file, initial_pos, SEEK_SET);
+      size_t len = strcspn (accepted_mime_type, ",");
+      if (len && strncmp (mime_type, accepted_mime_type, len) == 0)
+        return true;
 
-  unsigned long int blob_index_end = 0;
-  err = read_from_xz_compressed_cluster (file, blob_index_pos + offset_size, offset_size, &blob_index_end);
-  if (err)
-    {
-      fprintf (stderr, "zim.c : read_article_from_compressed_cluster() : can't find blob end position\n");
-      return strdup ("Error reading article.");
+      accepted_mime_type += len;
+      if (*accepted_mime_type == ',')
+        accepted_mime_type++;
     }
-  fseek (file, initial_pos, SEEK_SET);
 
-  size_t len = blob_index_end - blob_index;
-  content = xalloc (MAX_ARTICLE_SIZE);
-  read_from_xz_compressed_cluster (file, blob_index, len, content);
-
-  return content;
+  return false;
 }
 
 /*
- * Read a whole article from a ZSTD compressed cluster.
- *
- * The position of the cluster is retrieved from the provided `entry`.
- *
- * Return NULL in case of error.
+ * Tell, for each mime-type of the archive, if it's accepted by the comma
+ * separated list `list`, see is_accepted_mimetype().
  */
-static char *
-read_article_from_zstd_compressed_cluster (const zim_directory_entry_t *entry, FILE *file, size_t offset_size, size_t cluster_len)
+static bool *
+compile_mime_type_list (const zim_archive_t *archive, const char *list)
 {
-  char compressed[cluster_len];
-  char *buf = xalloc (MAX_ARTICLE_SIZE);
-  char *content = NULL;
-  size_t read = fread (compressed, 1, cluster_len, file);
-  if (read != cluster_len)
-    {
-      fprintf (stderr, "zim.c : read_article_from_zstd_compressed_cluster(): can't read cluster.\n.");
-      goto cleanup;
-    }
+  bool *accepted = xalloc (archive->mime_type_list->len + 1);
 
-  int err = ZSTD_decompress (buf, MAX_ARTICLE_SIZE, compressed, cluster_len);
-  if (ZSTD_isError (err))
-    {
-      fprintf (stderr, "zim.c : read_article_from_zstd_compressed_cluster(): can't decompress cluster: %s\n.", ZSTD_getErrorName(err));
-      goto cleanup;
-    }
+  for (size_t i = 0; i < archive->mime_type_list->len; i++)
+    accepted[i] = is_accepted_mimetype (archive->mime_type_list->items[i], list);
 
-  char *pos = buf;
-  pos += offset_size * entry->blob_number;
+  return accepted;
+}
 
-  unsigned long int blob_index = 0;
-  err = read_int_from_buf (pos, offset_size, &blob_index);
-  if (err)
-    {
-      fprintf (stderr, "zim.c : read_article_from_zstd_compressed_cluster(): corrupted zimfile : can't read blob index\n.");
-      goto cleanup;
-    }
+/*
+ * Compile `archive->options` in `archive->filter`, so entries can be
+ * filtered on their mime-type number and namespace without looking at
+ * strings.
+ */
+static void
+compile_filter (zim_archive_t *archive)
+{
+  const zim_dump_options_t *options = archive->options;
+  zim_filter_t *filter = &archive->filter;
 
-  pos += offset_size;
-  unsigned long int blob_end_index = 0;
+  filter->mime_types_count = archive->mime_type_list->len;
 
-  err = read_int_from_buf (pos, offset_size, &blob_end_index);
-  if (err)
-    {
-      fprintf (stderr, "zim.c : read_article_from_zstd_compressed_cluster(): corrupted zimfile : can't read blob end index\n.");
-      goto cleanup;
-    }
+  for (size_t i = 0; i < sizeof (filter->namespaces); i++)
+    filter->namespaces[i] = !options || !options->namespaces;
 
-  pos = buf + blob_index;
-  content = strndup (pos, blob_end_index - blob_index);
+  if (!options)
+    return;
 
-  cleanup:
-  free (buf);
-  return content;
+  if (options->mime_type_whitelist)
+    filter->whitelisted = compile_mime_type_list (archive, options->mime_type_whitelist);
+  if (options->mime_types)
+    filter->mime_types = compile_mime_type_list (archive, options->mime_types);
+  if (options->namespaces)
+    for (const char *namespace = options->namespaces; *namespace; namespace++)
+      filter->namespaces[(unsigned char) *namespace] = true;
+
+  filter->min_size = options->min_size;
+  filter->max_size = options->max_size;
 }
 
 /*
- * Read a whole article from an uncompressed cluster.
+ * Parse the zimfile at `path` into `archive`.
  *
- * The position of the cluster is retrieved from the provided `entry`.
+ * This will fill the header information so the rest of the content can be
+ * reached, and compile the filters of `archive->options`.
  *
- * Return NULL in case of error.
+ * You must allocate memory for `archive`.
+ *
+ * Return non-zero in case of error.
  */
-static char *
-read_article_from_uncompressed_cluster (const zim_directory_entry_t *entry, FILE *file, size_t offset_size)
+static int
+zim_parse (const char *path, zim_archive_t *archive)
 {
-  char *content = NULL;
+  int err = 0;
 
-  fseek (file, offset_size * entry->blob_number, SEEK_CUR);
-  unsigned long int blob_index = 0;
-  int err = read_int (file, offset_size, &blob_index);
+  err = open_archive_file (path, archive);
   if (err)
-    {
-      fprintf (stderr, "zim.c : read_article_from_uncompressed_cluster(): corrupted zimfile : can't read blob index\n.");
-      goto cleanup;
-    }
+    goto cleanup;
 
-  unsigned long int blob_end_index = 0;
-  err = read_int (file, offset_size, &blob_end_index);
+  archive->path = strdup (path);
+
+  err = parse_headers (archive);
   if (err)
     {
-      fprintf (stderr, "zim.c : read_article_from_uncompressed_cluster(): corrupted zimfile : can't read blob end index\n.");
+      fprintf (stderr, "zim.c : zim_parse() : error while reading headers.\n");
       goto cleanup;
     }
 
-  if (fseek (file, blob_index - (offset_size * (entry->blob_number+2)), SEEK_CUR) == -1)
+  if (archive->header->magic_number != ZIM_MAGIC_NUMBER)
     {
-      fprintf (stderr, "zim.c : read_article_from_uncompressed_cluster() : can't use zimfile anymore.\n");
+      err = 1;
+      fprintf (stderr, "zim.c : zim_parse() : the magic number for this file does not match the one expected. This means it's either not a zimfile, or it's an incompatible version of one.\n");
       goto cleanup;
     }
 
-  content = xalloc (MAX_ARTICLE_SIZE);
-  if (!fgets (content, blob_end_index - blob_index, file))
+  err = parse_mime_type_list (archive);
+  if (err)
     {
-      fprintf (stderr, "zim.c : read_article_from_uncompressed_cluster() : can't read file.\n");
+      fprintf (stderr, "zim.c : zim_parse() : error while reading mime-types.\n");
       goto cleanup;
     }
 
-  cleanup:
-  return content;
-}
+  compile_filter (archive);
+
+  err = read_int (archive, archive->header->url_ptr_pos, 8, &archive->header->dir_entries_pos);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : zim_parse() :corrupted  zimfile : can't read dir entries position.\n");
+      goto cleanup;
+    }
+
+  if (archive->load_pointer_lists)
+    {
+      err = load_pointer_lists (archive);
+      if (err)
+        goto cleanup;
+    }
+
+  if (archive->resolve_redirects)
+    {
+      err = resolve_redirects (archive);
+      if (err)
+        goto cleanup;
+    }
+
+  archive->cluster_cache->slots_len = archive->header->cluster_count;
+  archive->cluster_cache->slots = xalloc ((archive->header->cluster_count + 1) * sizeof (*archive->cluster_cache->slots));
+  archive->cluster_cache->loaded_once = xalloc (archive->header->cluster_count / 8 + 1);
+
+  cleanup:
+  return err;
+}
 
 /*
- * Retrieve an article content given its directory entry.
+ * LZMA setup.
  *
- * Return NULL in case of error.
+ * Return non-zero in case of error.
  */
-static char *
-retrieve_directory_entry_content (const zim_archive_t *archive, const zim_directory_entry_t *entry)
+static int
+init_lzma_decoder (lzma_stream *strm)
 {
-  char *content = NULL;
-  FILE *file = NULL;
+  int err = 0;
+	lzma_ret ret = lzma_stream_decoder (strm, UINT64_MAX, 0);
 
-  file = fopen (archive->path, "r");
-  if (!file)
+	if (ret != LZMA_OK)
     {
-      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't open zimfile.\n");
-      goto cleanup;
+      err = 1;
+      const char *msg;
+
+      switch (ret)
+      {
+        case LZMA_MEM_ERROR:
+          msg = "Memory allocation failed";
+          break;
+
+        case LZMA_OPTIONS_ERROR:
+          msg = "Unsupported decompressor flags";
+          break;
+
+        default:
+          msg = "Unknown error, possibly a bug";
+          break;
+      }
+
+      fprintf(stderr, "Error initializing the lzma decoder: %s (error code %u)\n", msg, ret);
     }
-  if (fseek (file, archive->header->cluster_ptr_pos + (entry->cluster_number * 8), SEEK_SET) == -1)
+
+	return err;
+}
+
+/*
+ * Decompression state, kept per thread and reused from one cluster to the
+ * next rather than being set up again each time.
+ */
+typedef struct {
+  lzma_stream xz;
+  bool xz_ready;
+  ZSTD_DCtx *zstd;
+  char *zstd_buf;         // scratch output for frames of unknown or implausible size
+  size_t zstd_buf_capacity;
+} zim_decoder_t;
+
+static pthread_key_t DECODER_KEY;
+static pthread_once_t DECODER_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+static void
+free_zim_decoder (void *data)
+{
+  zim_decoder_t *decoder = data;
+  if (!decoder) return;
+
+  if (decoder->xz_ready) lzma_end (&decoder->xz);
+  if (decoder->zstd) ZSTD_freeDCtx (decoder->zstd);
+  if (decoder->zstd_buf) free (decoder->zstd_buf);
+  free (decoder);
+}
+
+static void
+create_decoder_key ()
+{
+  pthread_key_create (&DECODER_KEY, free_zim_decoder);
+}
+
+/*
+ * Get the decompression state of the calling thread, creating it on first
+ * use. It's released when the thread exits.
+ */
+static zim_decoder_t *
+get_thread_decoder ()
+{
+  pthread_once (&DECODER_KEY_ONCE, create_decoder_key);
+
+  zim_decoder_t *decoder = pthread_getspecific (DECODER_KEY);
+  if (!decoder)
     {
-      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't use zimfile anymore.\n");
-      goto cleanup;
+      decoder = xalloc (sizeof (*decoder));
+      lzma_stream init = LZMA_STREAM_INIT;
+      decoder->xz = init;
+      pthread_setspecific (DECODER_KEY, decoder);
     }
 
-  unsigned long cluster_start = 0;
-  int err = read_int (file, 8, &cluster_start);
-  if (err)
+  return decoder;
+}
+
+/*
+ * Find where the cluster `cluster_number` starts and ends in the zimfile.
+ *
+ * The last cluster ends where the checksum starts.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_cluster_position (const zim_archive_t *archive, unsigned int cluster_number, unsigned long int *start, unsigned long int *end)
+{
+  if (cluster_number >= archive->header->cluster_count)
     {
-      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : corrupted zimfile : can't read cluster start position.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : read_cluster_position() : corrupted zimfile : cluster %u does not exist.\n", cluster_number);
+      return 1;
     }
 
-  unsigned long cluster_end = 0;
-  if (entry->cluster_number < archive->header->cluster_count - 1)
+  if (archive->cluster_ptrs)
     {
-      err = read_int (file, 8, &cluster_end);
-      if (err)
+      *start = archive->cluster_ptrs[cluster_number];
+      *end = archive->cluster_ptrs[cluster_number + 1];
+    }
+  else
+    {
+      unsigned long int pos = archive->header->cluster_ptr_pos + (cluster_number * 8UL);
+      if (read_int (archive, pos, 8, start))
         {
-          fprintf (stderr, "zim.c : retrieve_directory_entry_content() : corrupted zimfile : can't read cluster end position.\n");
-          goto cleanup;
+          fprintf (stderr, "zim.c : read_cluster_position() : corrupted zimfile : can't read cluster start position.\n");
+          return 1;
+        }
+
+      if (cluster_number < archive->header->cluster_count - 1)
+        {
+          if (read_int (archive, pos + 8, 8, end))
+            {
+              fprintf (stderr, "zim.c : read_cluster_position() : corrupted zimfile : can't read cluster end position.\n");
+              return 1;
+            }
         }
+      else
+        *end = archive->header->checksum_pos;
     }
 
-  if (fseek (file, cluster_start, SEEK_SET) == -1)
+  if (*end <= *start + 1)
     {
-      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't use zimfile anymore.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : read_cluster_position() : corrupted zimfile : cluster %u has no content.\n", cluster_number);
+      return 1;
     }
 
-  int cluster_information;
-  int r = fread (&cluster_information, 1, 1, file);
-  if (r != 1)
+  if (*end > archive->size)
     {
-      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't read cluster information.\n");
-      goto cleanup;
+      fprintf (stderr, "zim.c : read_cluster_position() : corrupted zimfile : cluster %u ends past the end of file.\n", cluster_number);
+      return 1;
     }
-  int compressed = cluster_information & 0x0F;
-  int extended = cluster_information & 0x10;
-  size_t offset_size = extended ? 8 : 4;
-  size_t cluster_len = cluster_end - cluster_start - 1; // cluster start with an uncompressed byte for cluster info
 
-  if (compressed == COMPRESSION_XZ)
-    content = read_article_from_xz_compressed_cluster (entry, file, offset_size);
-  else if (compressed == COMPRESSION_ZSTD)
-    content = read_article_from_zstd_compressed_cluster (entry, file, offset_size, cluster_len);
-  else
-    content = read_article_from_uncompressed_cluster (entry, file, offset_size);
+  return 0;
+}
 
-  cleanup:
-  if (file) fclose (file);
-  return content;
+/*
+ * Message for a lzma_code() error.
+ */
+static const char *
+lzma_error_message (lzma_ret ret)
+{
+  switch (ret)
+    {
+      case LZMA_MEM_ERROR:
+        return "Memory allocation failed";
+
+      case LZMA_FORMAT_ERROR:
+        return "The input is not in the .xz format";
+
+      case LZMA_OPTIONS_ERROR:
+        return "Unsupported compression options";
+
+      case LZMA_DATA_ERROR:
+        return "Compressed file is corrupt";
+
+      case LZMA_BUF_ERROR:
+        return "Compressed file is truncated or otherwise corrupt";
+
+      default:
+        return "Unknown error, possibly a bug";
+    }
 }
 
 /*
- * Read document content in a given position is the list of articles.
+ * Decompress a whole XZ compressed cluster from `in` into `cluster`, in a
+ * single pass.
  *
- * This is mostly useful when iterating on all articles, otherwise it's
- * easier to find an article by its url.
+ * The lzma decoder of the calling thread is reused, so its memory is only
+ * allocated once rather than for each cluster.
  *
- * Return NULL in case of error.
+ * Return non-zero in case of error.
  */
-static char *
-read_article_at_index (zim_archive_t *archive, size_t i)
+static int
+decompress_xz_cluster (const char *in, size_t in_len, zim_cluster_t *cluster)
 {
-  FILE *file = NULL;
-  unsigned long int dir_entry = 0;
-  zim_directory_entry_t *entry = NULL;
-  char *content = NULL;
+  int err = 0;
+  zim_decoder_t *decoder = get_thread_decoder ();
+  lzma_stream *strm = &decoder->xz;
+  size_t capacity = in_len * 4 + BUFSIZ;
+  char *buf = xalloc (capacity);
 
-  file = fopen (archive->path, "r");
-  if (!file)
+  err = init_lzma_decoder (strm);
+  if (err)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : can't open archive file.\n");
+      fprintf (stderr, "zim.c : decompress_xz_cluster() : can't initialize lzma.\n");
       goto cleanup;
     }
+  decoder->xz_ready = true;
+
+  strm->next_in = (const uint8_t *) in;
+  strm->avail_in = in_len;
+  strm->next_out = (uint8_t *) buf;
+  strm->avail_out = capacity;
 
-  if (fseek (file, archive->header->url_ptr_pos + (i * 8), SEEK_SET) == -1)
+  while (true)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : zimefile corrupted : can't reach header position.\n");
-      goto cleanup;
+      lzma_ret ret = lzma_code (strm, LZMA_FINISH);
+      if (ret == LZMA_STREAM_END)
+        break;
+
+      if (ret != LZMA_OK)
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_xz_cluster() : Decoder error: %s (error code %u)\n", lzma_error_message (ret), ret);
+          goto cleanup;
+        }
+
+      if (strm->avail_out == 0)
+        {
+          buf = xrealloc (buf, capacity * 2);
+          strm->next_out = (uint8_t *) buf + capacity;
+          strm->avail_out = capacity;
+          capacity *= 2;
+        }
     }
-  if (!read_int (file, 8, &dir_entry))
+
+  cluster->len = strm->total_out;
+  cluster->data = xrealloc (buf, cluster->len ? cluster->len : 1);
+  buf = NULL;
+
+  cleanup:
+  if (buf) free (buf);
+  return err;
+}
+
+/*
+ * Decompress a whole ZSTD compressed cluster from `in` into `cluster`.
+ *
+ * The zstd context of the calling thread is reused. When the frame header
+ * tells the decompressed size, and it's at most TRUSTED_COMPRESSION_RATIO times
+ * the input, the output is allocated once at that exact size and decoded
+ * in one call. Otherwise the frame is streamed into a scratch buffer kept
+ * with the context, which only grows, and copied out.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+decompress_zstd_cluster (const char *in, size_t in_len, zim_cluster_t *cluster)
+{
+  int err = 0;
+  char *buf = NULL;
+  zim_decoder_t *decoder = get_thread_decoder ();
+
+  if (!decoder->zstd)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : zimefile corrupted : can't read entry index.\n");
-      goto cleanup;
+      decoder->zstd = ZSTD_createDCtx ();
+      if (!decoder->zstd)
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_cluster() : can't create zstd context.\n");
+          goto cleanup;
+        }
     }
 
-  if (fseek (file, dir_entry, SEEK_SET) == -1)
+  ZSTD_DCtx *dctx = decoder->zstd;
+  unsigned long long content_size = ZSTD_getFrameContentSize (in, in_len);
+  if (content_size == ZSTD_CONTENTSIZE_ERROR)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : zimefile corrupted : can't reach article position.\n");
+      err = 1;
+      fprintf (stderr, "zim.c : decompress_zstd_cluster() : corrupted zimfile : invalid zstd frame.\n");
       goto cleanup;
     }
 
-  entry = xalloc (sizeof (*entry));
-  int err = parse_directory_entry (file, entry);
-  if (err)
+  // the size in the frame header comes from the zimfile : it's only used
+  // to allocate the output at once when it's plausible for the input size
+  if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size <= (unsigned long long) in_len * TRUSTED_COMPRESSION_RATIO)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : corrupted zimfile : can't parse entry.\n");
+      buf = xalloc (content_size ? content_size : 1);
+      size_t ret = ZSTD_decompressDCtx (dctx, buf, content_size, in, in_len);
+      if (ZSTD_isError (ret))
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_cluster() : can't decompress cluster : %s\n", ZSTD_getErrorName (ret));
+          goto cleanup;
+        }
+
+      cluster->data = buf;
+      cluster->len = ret;
+      buf = NULL;
       goto cleanup;
     }
 
-  if (entry->mime_type == MIME_TYPE_REDIRECT)
+  if (!decoder->zstd_buf)
     {
-      content = read_article_at_index (archive, entry->redirect_index);
-      goto cleanup;
+      decoder->zstd_buf_capacity = in_len * 4 + ZSTD_DStreamOutSize ();
+      decoder->zstd_buf = xalloc (decoder->zstd_buf_capacity);
     }
 
-  if (entry->mime_type == MIME_TYPE_REDLINK || entry->mime_type == MIME_TYPE_DELETED)
+  ZSTD_DCtx_reset (dctx, ZSTD_reset_session_only);
+  ZSTD_inBuffer input = { in, in_len, 0 };
+  ZSTD_outBuffer output = { decoder->zstd_buf, decoder->zstd_buf_capacity, 0 };
+
+  while (true)
     {
-      fprintf (stderr, "zim.c : read_article_at_index() : non-existing or deleted page.\n");
-      goto cleanup;
+      size_t ret = ZSTD_decompressStream (dctx, &output, &input);
+      if (ZSTD_isError (ret))
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_cluster() : can't decompress cluster : %s\n", ZSTD_getErrorName (ret));
+          goto cleanup;
+        }
+
+      if (ret == 0)
+        break;
+
+      if (output.pos == output.size)
+        {
+          decoder->zstd_buf_capacity *= 2;
+          decoder->zstd_buf = xrealloc (decoder->zstd_buf, decoder->zstd_buf_capacity);
+          output.dst = decoder->zstd_buf;
+          output.size = decoder->zstd_buf_capacity;
+        }
+      else if (input.pos == input.size)
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_cluster() : corrupted zimfile : truncated cluster.\n");
+          goto cleanup;
+        }
     }
 
-  content = retrieve_directory_entry_content (archive, entry);
+  buf = xalloc (output.pos ? output.pos : 1);
+  memcpy (buf, decoder->zstd_buf, output.pos);
+  cluster->data = buf;
+  cluster->len = output.pos;
+  buf = NULL;
 
   cleanup:
-  if (entry) free_zim_directory_entry (entry);
-  if (file) fclose (file);
-  return content;
+  if (err && decoder->zstd) ZSTD_DCtx_reset (decoder->zstd, ZSTD_reset_session_only);
+  if (buf) free (buf);
+  return err;
 }
 
 /*
- * Read document content in a given url.
+ * Decompress at most the first `*len` bytes of a XZ compressed cluster from
+ * `in` into `out`, setting `len` to how many there were.
  *
- * There is no http request performed, the url is the name given
- * to the record in the zimfile, coresponding to the path in the
- * url of the article where is was fetched from the web.
+ * Return non-zero in case of error.
+ */
+static int
+decompress_xz_prefix (const char *in, size_t in_len, char *out, size_t *len)
+{
+  zim_decoder_t *decoder = get_thread_decoder ();
+  lzma_stream *strm = &decoder->xz;
+
+  if (init_lzma_decoder (strm))
+    {
+      fprintf (stderr, "zim.c : decompress_xz_prefix() : can't initialize lzma.\n");
+      return 1;
+    }
+  decoder->xz_ready = true;
+
+  strm->next_in = (const uint8_t *) in;
+  strm->avail_in = in_len;
+  strm->next_out = (uint8_t *) out;
+  strm->avail_out = *len;
+
+  while (strm->avail_out > 0)
+    {
+      lzma_ret ret = lzma_code (strm, LZMA_FINISH);
+      if (ret == LZMA_STREAM_END)
+        break;
+
+      if (ret != LZMA_OK)
+        {
+          fprintf (stderr, "zim.c : decompress_xz_prefix() : Decoder error: %s (error code %u)\n", lzma_error_message (ret), ret);
+          return 1;
+        }
+    }
+
+  *len = strm->total_out;
+  return 0;
+}
+
+/*
+ * Decompress at most the first `*len` bytes of a ZSTD compressed cluster
+ * from `in` into `out`, setting `len` to how many there were.
  *
- * Return NULL in case of error.
+ * Return non-zero in case of error.
  */
-static char *
-read_article_at_url (zim_archive_t *archive, const char *url)
+static int
+decompress_zstd_prefix (const char *in, size_t in_len, char *out, size_t *len)
 {
-  char *content = NULL;
-  FILE *file = NULL;
-  unsigned long int dir_entry = 0;
-  zim_directory_entry_t *entry = NULL;
+  int err = 0;
+  zim_decoder_t *decoder = get_thread_decoder ();
+
+  if (!decoder->zstd)
+    {
+      decoder->zstd = ZSTD_createDCtx ();
+      if (!decoder->zstd)
+        {
+          fprintf (stderr, "zim.c : decompress_zstd_prefix() : can't create zstd context.\n");
+          return 1;
+        }
+    }
+
+  ZSTD_DCtx_reset (decoder->zstd, ZSTD_reset_session_only);
+  ZSTD_inBuffer input = { in, in_len, 0 };
+  ZSTD_outBuffer output = { out, *len, 0 };
+
+  while (output.pos < output.size)
+    {
+      size_t ret = ZSTD_decompressStream (decoder->zstd, &output, &input);
+      if (ZSTD_isError (ret))
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_prefix() : can't decompress cluster : %s\n", ZSTD_getErrorName (ret));
+          break;
+        }
+
+      if (ret == 0)
+        break;
+
+      if (input.pos == input.size && output.pos < output.size)
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : decompress_zstd_prefix() : corrupted zimfile : truncated cluster.\n");
+          break;
+        }
+    }
+
+  // the frame is usually left unfinished
+  ZSTD_DCtx_reset (decoder->zstd, ZSTD_reset_session_only);
+  *len = output.pos;
+  return err;
+}
+
+/*
+ * Decompress at most the first `*len` bytes of the cluster in `in`,
+ * compressed with `compression`, into `out`. `len` is set to how many
+ * bytes were decompressed, which is less only for shorter clusters.
+ *
+ * Decoding stops there, so it's much cheaper than reading the whole
+ * cluster when only its start is needed.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+decompress_cluster_prefix (const char *in, size_t in_len, int compression, char *out, size_t *len)
+{
+  int err = 0;
+  unsigned long long int started = stats_start ();
+
+  if (compression == COMPRESSION_XZ)
+    {
+      err = decompress_xz_prefix (in, in_len, out, len);
+      stats_end (STATS_XZ, started);
+    }
+  else if (compression == COMPRESSION_ZSTD)
+    {
+      err = decompress_zstd_prefix (in, in_len, out, len);
+      stats_end (STATS_ZSTD, started);
+    }
+  else
+    {
+      if (*len > in_len) *len = in_len;
+      memcpy (out, in, *len);
+    }
+
+  return err;
+}
+
+/*
+ * Read and decompress the whole cluster `cluster_number`.
+ *
+ * You must release the content with free_zim_cluster_content().
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_cluster (const zim_archive_t *archive, unsigned int cluster_number, zim_cluster_t *cluster)
+{
+  int err = 0;
+  char *copy = NULL;
+  unsigned long int start = 0;
+  unsigned long int end = 0;
+  unsigned char cluster_information = 0;
+
+  err = read_cluster_position (archive, cluster_number, &start, &end);
+  if (err)
+    goto cleanup;
+
+  err = read_at (archive, start, 1, &cluster_information);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : read_cluster() : can't read cluster information.\n");
+      goto cleanup;
+    }
+
+  int compressed = cluster_information & 0x0F;
+  int extended = cluster_information & 0x10;
+  size_t raw_len = end - start - 1; // cluster start with an uncompressed byte for cluster info
+  cluster->number = cluster_number;
+  cluster->offset_size = extended ? 8 : 4;
+
+  unsigned long long int started = stats_start ();
+  const char *raw = view_at (archive, start + 1, raw_len, &copy);
+  stats_end (STATS_CLUSTER_READ, started);
+  if (!raw)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster() : can't read cluster %u.\n", cluster_number);
+      goto cleanup;
+    }
+
+  started = stats_start ();
+  if (compressed == COMPRESSION_XZ)
+    {
+      err = decompress_xz_cluster (raw, raw_len, cluster);
+      stats_end (STATS_XZ, started);
+      stats_count (STATS_XZ_CLUSTERS, 1);
+      stats_count (STATS_XZ_IN, raw_len);
+      stats_count (STATS_XZ_OUT, err ? 0 : cluster->len);
+    }
+  else if (compressed == COMPRESSION_ZSTD)
+    {
+      err = decompress_zstd_cluster (raw, raw_len, cluster);
+      stats_end (STATS_ZSTD, started);
+      stats_count (STATS_ZSTD_CLUSTERS, 1);
+      stats_count (STATS_ZSTD_IN, raw_len);
+      stats_count (STATS_ZSTD_OUT, err ? 0 : cluster->len);
+    }
+  else
+    {
+      cluster->len = raw_len;
+      cluster->data = raw;
+      cluster->mapped = (copy == NULL);
+      copy = NULL;
+      stats_count (STATS_STORED_CLUSTERS, 1);
+    }
+
+  cleanup:
+  if (copy) free (copy);
+  return err;
+}
+
+/*
+ * Start decompressing the `raw_len` bytes found at `pos` in the zimfile,
+ * compressed with `compression`.
+ *
+ * Return NULL in case of error.
+ */
+static zim_cluster_stream_t *
+open_cluster_stream (const zim_archive_t *archive, unsigned long int pos, size_t raw_len, int compression)
+{
+  zim_cluster_stream_t *stream = xalloc (sizeof (*stream));
+  lzma_stream init = LZMA_STREAM_INIT;
+  const char *raw = NULL;
+
+  stream->archive = archive;
+  stream->compression = compression;
+  stream->xz = init;
+
+  if (archive->map)
+    {
+      raw = view_at (archive, pos, raw_len, &stream->copy);
+      if (!raw)
+        goto error;
+    }
+  else
+    {
+      stream->copy_len = raw_len < STREAM_CHUNK_SIZE ? raw_len : STREAM_CHUNK_SIZE;
+      stream->copy = xalloc (stream->copy_len ? stream->copy_len : 1);
+      stream->pos = pos;
+      stream->pending = raw_len;
+      raw_len = 0;
+    }
+
+  if (compression == COMPRESSION_XZ)
+    {
+      if (init_lzma_decoder (&stream->xz))
+        goto error;
+
+      stream->xz.next_in = (const uint8_t *) raw;
+      stream->xz.avail_in = raw_len;
+    }
+  else
+    {
+      stream->zstd = ZSTD_createDCtx ();
+      if (!stream->zstd)
+        goto error;
+
+      stream->input = (ZSTD_inBuffer) { raw, raw_len, 0 };
+    }
+
+  return stream;
+
+  error:
+  fprintf (stderr, "zim.c : open_cluster_stream() : can't initialize decoder.\n");
+  free_cluster_stream (stream);
+  return NULL;
+}
+
+/*
+ * Memory used by `stream`, counted in the cluster cache.
+ */
+static size_t
+cluster_stream_size (const zim_cluster_stream_t *stream)
+{
+  if (!stream) return 0;
+
+  size_t size = sizeof (*stream) + stream->copy_len;
+  if (stream->compression == COMPRESSION_XZ)
+    size += lzma_memusage (&stream->xz);
+  else
+    size += ZSTD_sizeof_DCtx (stream->zstd);
+
+  return size;
+}
+
+/*
+ * Read the next chunk of compressed input of `stream` from the zimfile.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+refill_cluster_stream (zim_cluster_stream_t *stream)
+{
+  size_t len = stream->pending < stream->copy_len ? stream->pending : stream->copy_len;
+
+  if (read_at (stream->archive, stream->pos, len, stream->copy))
+    return 1;
+
+  stream->pos += len;
+  stream->pending -= len;
+
+  if (stream->compression == COMPRESSION_XZ)
+    {
+      stream->xz.next_in = (const uint8_t *) stream->copy;
+      stream->xz.avail_in = len;
+    }
+  else
+    stream->input = (ZSTD_inBuffer) { stream->copy, len, 0 };
+
+  return 0;
+}
+
+/*
+ * Decompress the next `len` bytes of `stream` in `out`, and set `produced`
+ * to how many there were.
+ *
+ * Return non-zero in case of error, or if the cluster ends before.
+ */
+static int
+read_cluster_stream (zim_cluster_stream_t *stream, char *out, size_t len, size_t *produced)
+{
+  int err = 0;
+  unsigned long long int started = stats_start ();
+
+  if (stream->compression == COMPRESSION_XZ)
+    {
+      stream->xz.next_out = (uint8_t *) out;
+      stream->xz.avail_out = len;
+
+      while (stream->xz.avail_out > 0)
+        {
+          if (stream->xz.avail_in == 0 && stream->pending > 0 && refill_cluster_stream (stream))
+            {
+              err = 1;
+              break;
+            }
+
+          lzma_ret ret = lzma_code (&stream->xz, stream->pending > 0 ? LZMA_RUN : LZMA_FINISH);
+          if (ret == LZMA_STREAM_END)
+            break;
+
+          if (ret != LZMA_OK)
+            {
+              err = 1;
+              fprintf (stderr, "zim.c : read_cluster_stream() : Decoder error: %s (error code %u)\n", lzma_error_message (ret), ret);
+              break;
+            }
+        }
+
+      *produced = len - stream->xz.avail_out;
+      stats_end (STATS_XZ, started);
+      stats_count (STATS_XZ_OUT, *produced);
+    }
+  else
+    {
+      ZSTD_outBuffer output = { out, len, 0 };
+
+      while (output.pos < output.size)
+        {
+          if (stream->input.pos == stream->input.size && stream->pending > 0 && refill_cluster_stream (stream))
+            {
+              err = 1;
+              break;
+            }
+
+          size_t ret = ZSTD_decompressStream (stream->zstd, &output, &stream->input);
+          if (ZSTD_isError (ret))
+            {
+              err = 1;
+              fprintf (stderr, "zim.c : read_cluster_stream() : can't decompress cluster : %s\n", ZSTD_getErrorName (ret));
+              break;
+            }
+
+          if (ret == 0 || (stream->input.pos == stream->input.size && stream->pending == 0))
+            break;
+        }
+
+      *produced = output.pos;
+      stats_end (STATS_ZSTD, started);
+      stats_count (STATS_ZSTD_OUT, *produced);
+    }
+
+  if (!err && *produced < len)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster_stream() : corrupted zimfile : truncated cluster.\n");
+    }
+
+  return err;
+}
+
+/*
+ * Go on decompressing `stream` in `out`, from `*decoded` bytes up to
+ * `until` bytes, and set `decoded` to where it stopped.
+ *
+ * Return non-zero in case of error, or if the cluster ends before `until`.
+ */
+static int
+continue_cluster_stream (zim_cluster_stream_t *stream, char *out, size_t *decoded, size_t until)
+{
+  size_t produced = 0;
+  int err = read_cluster_stream (stream, out + *decoded, until - *decoded, &produced);
+  *decoded += produced;
+  return err;
+}
+
+/*
+ * Decompress and drop the next `len` bytes of `stream`, using `buf` of
+ * STREAM_CHUNK_SIZE bytes.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+skip_cluster_stream (zim_cluster_stream_t *stream, char *buf, size_t len)
+{
+  size_t produced = 0;
+
+  while (len > 0)
+    {
+      if (read_cluster_stream (stream, buf, len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE, &produced))
+        return 1;
+
+      len -= produced;
+    }
+
+  return 0;
+}
+
+/*
+ * Where blob `blob_number` ends in `cluster`, according to its offset
+ * table. That's the end of the cluster for ALL_BLOBS, and for blobs which
+ * are not in the table.
+ */
+static size_t
+cluster_blob_end (const zim_cluster_t *cluster, unsigned int blob_number)
+{
+  unsigned long int table_len = 0;
+  unsigned long int end = 0;
+  size_t pos = cluster->offset_size * ((size_t) blob_number + 1);
+
+  if (blob_number == ALL_BLOBS || cluster->len < cluster->offset_size)
+    return cluster->len;
+
+  read_int_from_buf (cluster->data, cluster->offset_size, &table_len);
+  if (pos + cluster->offset_size > table_len || table_len > cluster->len)
+    return cluster->len;
+
+  read_int_from_buf (cluster->data + pos, cluster->offset_size, &end);
+  return end < cluster->len ? end : cluster->len;
+}
+
+/*
+ * Read the cluster `cluster_number` in `cached`, decompressing it only up
+ * to the end of blob `last_blob`. The decompression state is then kept in
+ * `cached->stream` until the rest is needed, see get_cluster().
+ *
+ * The offset table is decompressed first, its last offset telling the size
+ * of the whole cluster, so its content is allocated once and never moves.
+ *
+ * Uncompressed clusters are read whole, see read_cluster(), and so are the
+ * ones announcing more than TRUSTED_COMPRESSION_RATIO times their
+ * compressed size.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_cluster_prefix (const zim_archive_t *archive, unsigned int cluster_number, unsigned int last_blob, zim_cached_cluster_t *cached)
+{
+  int err = 0;
+  char *table = NULL;
+  unsigned long int start = 0;
+  unsigned long int end = 0;
+  unsigned long int table_len = 0;
+  unsigned long int cluster_len = 0;
+  unsigned char cluster_information = 0;
+  zim_cluster_t *cluster = &cached->cluster;
+
+  err = read_cluster_position (archive, cluster_number, &start, &end);
+  if (err)
+    goto cleanup;
+
+  if (end <= start || read_at (archive, start, 1, &cluster_information))
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster_prefix() : can't read cluster information.\n");
+      goto cleanup;
+    }
+
+  int compression = cluster_information & 0x0F;
+  if (compression != COMPRESSION_XZ && compression != COMPRESSION_ZSTD)
+    {
+      err = read_cluster (archive, cluster_number, cluster);
+      cached->decoded = cluster->len;
+      goto cleanup;
+    }
+
+  size_t offset_size = cluster_information & 0x10 ? 8 : 4;
+  size_t raw_len = end - start - 1;
+  cluster->number = cluster_number;
+  cluster->offset_size = offset_size;
+
+  cached->stream = open_cluster_stream (archive, start + 1, raw_len, compression);
+  if (!cached->stream)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster_prefix() : can't read cluster %u.\n", cluster_number);
+      goto cleanup;
+    }
+
+  size_t decoded = 0;
+  table = xalloc (offset_size);
+  err = continue_cluster_stream (cached->stream, table, &decoded, offset_size);
+  if (err)
+    goto cleanup;
+
+  // a cluster can't hold more blobs than there are entries
+  read_int_from_buf (table, offset_size, &table_len);
+  if (table_len < 2 * offset_size || table_len % offset_size || table_len / offset_size > archive->header->article_count + 1UL)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster_prefix() : corrupted zimfile : invalid offsets in cluster %u.\n", cluster_number);
+      goto cleanup;
+    }
+
+  table = xrealloc (table, table_len);
+  err = continue_cluster_stream (cached->stream, table, &decoded, table_len);
+  if (err)
+    goto cleanup;
+
+  read_int_from_buf (table + table_len - offset_size, offset_size, &cluster_len);
+  if (cluster_len < table_len)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_cluster_prefix() : corrupted zimfile : invalid offsets in cluster %u.\n", cluster_number);
+      goto cleanup;
+    }
+
+  // don't allocate on an unlikely size, decode the whole cluster instead
+  // so that its real size is found, or its corruption reported
+  if (cluster_len > (unsigned long long) raw_len * TRUSTED_COMPRESSION_RATIO)
+    {
+      free_cluster_stream (cached->stream);
+      cached->stream = NULL;
+      err = read_cluster (archive, cluster_number, cluster);
+      cached->decoded = err ? 0 : cluster->len;
+      goto cleanup;
+    }
+
+  stats_count (compression == COMPRESSION_XZ ? STATS_XZ_CLUSTERS : STATS_ZSTD_CLUSTERS, 1);
+  stats_count (compression == COMPRESSION_XZ ? STATS_XZ_IN : STATS_ZSTD_IN, raw_len);
+
+  char *data = xalloc (cluster_len);
+  memcpy (data, table, table_len);
+  cluster->data = data;
+  cluster->len = cluster_len;
+
+  err = continue_cluster_stream (cached->stream, data, &decoded, cluster_blob_end (cluster, last_blob));
+  cached->decoded = decoded;
+
+  cleanup:
+  if (cached->stream && (err || cached->decoded == cluster->len))
+    {
+      free_cluster_stream (cached->stream);
+      cached->stream = NULL;
+    }
+  if (table) free (table);
+  return err;
+}
+
+/*
+ * Locate blob `blob_number` in a decompressed cluster.
+ *
+ * `blob` will point inside the cluster data, it is not a copy.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+cluster_blob (const zim_cluster_t *cluster, unsigned int blob_number, const char **blob, size_t *len)
+{
+  unsigned long int blob_index = 0;
+  unsigned long int blob_end_index = 0;
+  size_t pos = cluster->offset_size * blob_number;
+
+  if (pos + 2 * cluster->offset_size > cluster->len)
+    {
+      fprintf (stderr, "zim.c : cluster_blob() : corrupted zimfile : blob %u is out of cluster %u.\n", blob_number, cluster->number);
+      return 1;
+    }
+
+  if (read_int_from_buf (cluster->data + pos, cluster->offset_size, &blob_index)
+      || read_int_from_buf (cluster->data + pos + cluster->offset_size, cluster->offset_size, &blob_end_index))
+    {
+      fprintf (stderr, "zim.c : cluster_blob() : corrupted zimfile : can't read blob offsets.\n");
+      return 1;
+    }
+
+  if (blob_end_index < blob_index || blob_end_index > cluster->len)
+    {
+      fprintf (stderr, "zim.c : cluster_blob() : corrupted zimfile : invalid offsets for blob %u in cluster %u.\n", blob_number, cluster->number);
+      return 1;
+    }
+
+  *blob = cluster->data + blob_index;
+  *len = blob_end_index - blob_index;
+
+  return 0;
+}
+
+/*
+ * Move `cached` at the head of the cache's recently used list.
+ */
+static void
+touch_cached_cluster (zim_cluster_cache_t *cache, zim_cached_cluster_t *cached)
+{
+  if (cache->newest == cached) return;
+
+  if (cached->newer) cached->newer->older = cached->older;
+  if (cached->older) cached->older->newer = cached->newer;
+  if (cache->oldest == cached) cache->oldest = cached->newer;
+
+  cached->newer = NULL;
+  cached->older = cache->newest;
+  if (cache->newest) cache->newest->newer = cached;
+  cache->newest = cached;
+  if (!cache->oldest) cache->oldest = cached;
+}
+
+/*
+ * Memory used by a cluster in the cache. Clusters pointing directly into
+ * the memory mapping of the zimfile only cost their bookkeeping, and
+ * partly decompressed ones their decompression state as well.
+ */
+static size_t
+cached_cluster_size (const zim_cached_cluster_t *cached)
+{
+  return sizeof (*cached) + (cached->cluster.mapped ? 0 : cached->cluster.len) + cluster_stream_size (cached->stream);
+}
+
+/*
+ * Count `cached` in the cache for its current size.
+ *
+ * Must be called with the cache lock held.
+ */
+static void
+resize_cached_cluster (zim_cluster_cache_t *cache, zim_cached_cluster_t *cached)
+{
+  cache->size -= cached->size;
+  cached->size = cached_cluster_size (cached);
+  cache->size += cached->size;
+}
+
+/*
+ * Drop least recently used clusters until the cache fits in its budget.
+ *
+ * Clusters in use are kept, even if it means going over budget.
+ *
+ * Must be called with the cache lock held.
+ */
+static void
+evict_cached_clusters (zim_cluster_cache_t *cache)
+{
+  zim_cached_cluster_t *cached = cache->oldest;
+
+  while (cache->size > cache->max_size && cached)
+    {
+      zim_cached_cluster_t *newer = cached->newer;
+
+      if (cached->users == 0)
+        {
+          if (cached->newer) cached->newer->older = cached->older;
+          else cache->newest = cached->older;
+          if (cached->older) cached->older->newer = cached->newer;
+          else cache->oldest = cached->newer;
+
+          cache->slots[cached->cluster.number] = NULL;
+          cache->size -= cached->size;
+          free_zim_cluster_content (&cached->cluster);
+          free_cluster_stream (cached->stream);
+          free (cached);
+        }
+
+      cached = newer;
+    }
+}
+
+/*
+ * Decompress `cached` further, up to the end of blob `last_blob`, when it
+ * was only partly decompressed. The caller must be one of its users, and
+ * hold the cache lock, which is released while decompressing.
+ *
+ * Other threads wanting blobs which are not decompressed yet wait until
+ * it's done, see is_cluster_pending().
+ *
+ * Return non-zero in case of error.
+ */
+static int
+continue_cached_cluster (zim_cluster_cache_t *cache, zim_cached_cluster_t *cached, unsigned int last_blob)
+{
+  int err = 0;
+  size_t until = cluster_blob_end (&cached->cluster, last_blob);
+
+  if (!cached->stream || cached->decoded >= until)
+    return 0;
+
+  cached->decoding = true;
+  pthread_mutex_unlock (&cache->lock);
+
+  size_t decoded = cached->decoded;
+  err = continue_cluster_stream (cached->stream, (char *) cached->cluster.data, &decoded, until);
+
+  pthread_mutex_lock (&cache->lock);
+  cached->decoded = decoded;
+
+  // on error, the stream is kept so the next calls fail as well
+  if (!err && decoded == cached->cluster.len)
+    {
+      free_cluster_stream (cached->stream);
+      cached->stream = NULL;
+    }
+
+  cached->decoding = false;
+  resize_cached_cluster (cache, cached);
+  pthread_cond_broadcast (&cache->loaded);
+  return err;
+}
+
+/*
+ * Tell if a thread wanting blobs up to `last_blob` of `cached` must wait
+ * for another thread : while the cluster is first loaded, or while it's
+ * decompressed further and those blobs are not there yet.
+ *
+ * Must be called with the cache lock held.
+ */
+static bool
+is_cluster_pending (const zim_cached_cluster_t *cached, unsigned int last_blob)
+{
+  return cached->loading || (cached->decoding && cluster_blob_end (&cached->cluster, last_blob) > cached->decoded);
+}
+
+/*
+ * Get the decompressed cluster `cluster_number`, from the archive's cache if
+ * it's there, or by reading it from the zimfile otherwise.
+ *
+ * With `archive->partial_clusters`, compressed clusters are only
+ * decompressed up to the end of blob `last_blob`, and further when later
+ * calls need more, see read_cluster_prefix(). Only blobs up to `last_blob`
+ * can then be read. With ALL_BLOBS, or without `partial_clusters`, the
+ * whole cluster is decompressed.
+ *
+ * The returned cluster belongs to the cache, and must be given back with
+ * release_cluster() once done with it.
+ *
+ * This can be called from several threads at once.
+ *
+ * Return NULL in case of error.
+ */
+static const zim_cluster_t *
+get_cluster (const zim_archive_t *archive, unsigned int cluster_number, unsigned int last_blob)
+{
+  zim_cluster_cache_t *cache = archive->cluster_cache;
+  zim_cached_cluster_t *cached = NULL;
+
+  if (cluster_number >= cache->slots_len)
+    {
+      fprintf (stderr, "zim.c : get_cluster() : corrupted zimfile : cluster %u does not exist.\n", cluster_number);
+      return NULL;
+    }
+
+  if (!archive->partial_clusters)
+    last_blob = ALL_BLOBS;
+
+  pthread_mutex_lock (&cache->lock);
+
+  while ((cached = cache->slots[cluster_number]) && is_cluster_pending (cached, last_blob))
+    pthread_cond_wait (&cache->loaded, &cache->lock);
+
+  if (cached)
+    {
+      cached->users++;
+      touch_cached_cluster (cache, cached);
+      int err = continue_cached_cluster (cache, cached, last_blob);
+      if (err)
+        cached->users--;
+      evict_cached_clusters (cache);
+      pthread_mutex_unlock (&cache->lock);
+      stats_count (STATS_CACHE_HITS, 1);
+      return err ? NULL : &cached->cluster;
+    }
+
+  unsigned char bit = 1 << (cluster_number % 8);
+  stats_count (STATS_CACHE_MISSES, 1);
+  if (!(cache->loaded_once[cluster_number / 8] & bit))
+    {
+      cache->loaded_once[cluster_number / 8] |= bit;
+      stats_count (STATS_DISTINCT_CLUSTERS, 1);
+    }
+
+  cached = xalloc (sizeof (*cached));
+  cached->loading = true;
+  cached->users = 1;
+  cache->slots[cluster_number] = cached;
+  pthread_mutex_unlock (&cache->lock);
+
+  int err = 0;
+  if (last_blob == ALL_BLOBS)
+    {
+      err = read_cluster (archive, cluster_number, &cached->cluster);
+      cached->decoded = cached->cluster.len;
+    }
+  else
+    err = read_cluster_prefix (archive, cluster_number, last_blob, cached);
+
+  pthread_mutex_lock (&cache->lock);
+  cached->loading = false;
+
+  if (err)
+    {
+      cache->slots[cluster_number] = NULL;
+      free_zim_cluster_content (&cached->cluster);
+      free (cached);
+      cached = NULL;
+    }
+  else
+    {
+      resize_cached_cluster (cache, cached);
+      touch_cached_cluster (cache, cached);
+      evict_cached_clusters (cache);
+    }
+
+  pthread_cond_broadcast (&cache->loaded);
+  pthread_mutex_unlock (&cache->lock);
+
+  return cached ? &cached->cluster : NULL;
+}
+
+/*
+ * Give back a cluster obtained with get_cluster().
+ */
+static void
+release_cluster (const zim_archive_t *archive, const zim_cluster_t *cluster)
+{
+  zim_cluster_cache_t *cache = archive->cluster_cache;
+  zim_cached_cluster_t *cached = (zim_cached_cluster_t *) cluster;
+
+  pthread_mutex_lock (&cache->lock);
+  cached->users--;
+  evict_cached_clusters (cache);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+/*
+ * Release a blob given by retrieve_directory_entry_content().
+ *
+ * Safe to call on an empty blob.
+ */
+static void
+release_blob (const zim_archive_t *archive, zim_blob_t *blob)
+{
+  if (blob->cluster) release_cluster (archive, blob->cluster);
+  blob->cluster = NULL;
+  blob->data = NULL;
+  blob->len = 0;
+}
+
+/*
+ * Find the size of blob `blob_number` in the offset table `data`, of `len`
+ * bytes.
+ *
+ * Return non-zero if the table doesn't have that blob.
+ */
+static int
+blob_size_from_offsets (const char *data, size_t len, size_t offset_size, unsigned int blob_number, size_t *size)
+{
+  unsigned long int blob_index = 0;
+  unsigned long int blob_end_index = 0;
+  size_t pos = offset_size * blob_number;
+
+  if (pos + 2 * offset_size > len)
+    return 1;
+
+  read_int_from_buf (data + pos, offset_size, &blob_index);
+  read_int_from_buf (data + pos + offset_size, offset_size, &blob_end_index);
+  if (blob_end_index < blob_index)
+    return 1;
+
+  *size = blob_end_index - blob_index;
+  return 0;
+}
+
+/*
+ * Decompress the offset table at the start of a compressed cluster in
+ * `table`, without the blobs which follow it.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_offset_table (const zim_archive_t *archive, const char *raw, size_t raw_len, int compression, zim_offset_table_t *table)
+{
+  size_t len = OFFSET_TABLE_PREFIX_SIZE;
+  unsigned long int table_len = 0;
+
+  table->data = xalloc (len);
+  if (decompress_cluster_prefix (raw, raw_len, compression, table->data, &len))
+    return 1;
+
+  if (len < table->offset_size || read_int_from_buf (table->data, table->offset_size, &table_len))
+    {
+      fprintf (stderr, "zim.c : read_offset_table() : corrupted zimfile : can't read offsets of cluster %u.\n", table->cluster_number);
+      return 1;
+    }
+
+  // a cluster can't hold more blobs than there are entries
+  if (table_len < table->offset_size || table_len / table->offset_size > archive->header->article_count + 1UL)
+    {
+      fprintf (stderr, "zim.c : read_offset_table() : corrupted zimfile : invalid offsets in cluster %u.\n", table->cluster_number);
+      return 1;
+    }
+
+  if (table_len > len)
+    {
+      len = table_len;
+      table->data = xrealloc (table->data, len);
+      if (decompress_cluster_prefix (raw, raw_len, compression, table->data, &len))
+        return 1;
+
+      if (len < table_len)
+        {
+          fprintf (stderr, "zim.c : read_offset_table() : corrupted zimfile : truncated offsets in cluster %u.\n", table->cluster_number);
+          return 1;
+        }
+    }
+
+  table->len = table_len;
+  return 0;
+}
+
+/*
+ * Find the size of the content of `entry` from the offset table of its
+ * cluster, without decompressing the content itself.
+ *
+ * Offsets are read from the file for uncompressed clusters, and from the
+ * cluster itself when it's in cache. Otherwise, only the start of the
+ * cluster is decompressed, up to the end of its offset table, which is kept
+ * in `offset_tables` for the next blobs of that cluster.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_blob_size (const zim_archive_t *archive, const zim_directory_entry_t *entry, size_t *size)
+{
+  int err = 0;
+  char *copy = NULL;
+  bool found = false;
+  unsigned long int start = 0;
+  unsigned long int end = 0;
+  unsigned char cluster_information = 0;
+  zim_cluster_cache_t *cache = archive->cluster_cache;
+  zim_offset_table_t *cached_table = &cache->offset_tables[entry->cluster_number % OFFSET_TABLES_COUNT];
+  zim_offset_table_t table = { .cluster_number = entry->cluster_number };
+
+  err = read_cluster_position (archive, entry->cluster_number, &start, &end);
+  if (err)
+    goto cleanup;
+
+  pthread_mutex_lock (&cache->lock);
+  zim_cached_cluster_t *cached = cache->slots[entry->cluster_number];
+  if (cached && !cached->loading)
+    {
+      // partly decompressed clusters only have their offset table for sure
+      const zim_cluster_t *cluster = &cached->cluster;
+      unsigned long int table_len = 0;
+      if (cluster->len >= cluster->offset_size)
+        read_int_from_buf (cluster->data, cluster->offset_size, &table_len);
+
+      found = true;
+      err = blob_size_from_offsets (cluster->data, table_len < cluster->len ? table_len : cluster->len, cluster->offset_size, entry->blob_number, size);
+    }
+  else if (cached_table->data && cached_table->cluster_number == entry->cluster_number)
+    {
+      found = true;
+      err = blob_size_from_offsets (cached_table->data, cached_table->len, cached_table->offset_size, entry->blob_number, size);
+    }
+  pthread_mutex_unlock (&cache->lock);
+
+  if (found)
+    goto cleanup;
+
+  if (end <= start || read_at (archive, start, 1, &cluster_information))
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_blob_size() : can't read cluster information.\n");
+      goto cleanup;
+    }
+
+  int compression = cluster_information & 0x0F;
+  table.offset_size = cluster_information & 0x10 ? 8 : 4;
+
+  if (compression != COMPRESSION_XZ && compression != COMPRESSION_ZSTD)
+    {
+      char offsets[16];
+      unsigned long int table_len = 0;
+      unsigned long int pos = start + 1 + table.offset_size * entry->blob_number;
+
+      err = read_int (archive, start + 1, table.offset_size, &table_len)
+        || pos + 2 * table.offset_size > start + 1 + table_len
+        || read_at (archive, pos, 2 * table.offset_size, offsets)
+        || blob_size_from_offsets (offsets, sizeof (offsets), table.offset_size, 0, size);
+
+      goto cleanup;
+    }
+
+  size_t raw_len = end - start - 1;
+  const char *raw = view_at (archive, start + 1, raw_len, &copy);
+  if (!raw)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : read_blob_size() : can't read cluster %u.\n", entry->cluster_number);
+      goto cleanup;
+    }
+
+  err = read_offset_table (archive, raw, raw_len, compression, &table);
+  if (err)
+    goto cleanup;
+
+  err = blob_size_from_offsets (table.data, table.len, table.offset_size, entry->blob_number, size);
+
+  pthread_mutex_lock (&cache->lock);
+  char *replaced = cached_table->data;
+  *cached_table = table;
+  pthread_mutex_unlock (&cache->lock);
+  table.data = replaced;
+
+  cleanup:
+  if (err) fprintf (stderr, "zim.c : read_blob_size() : can't find size of blob %u in cluster %u.\n", entry->blob_number, entry->cluster_number);
+  if (table.data) free (table.data);
+  if (copy) free (copy);
+  return err;
+}
+
+/*
+ * Retrieve an article content given its directory entry.
+ *
+ * `blob` points inside the cached cluster, it is not a copy : the cluster
+ * is kept in cache until you call release_blob(). The content is not NUL
+ * terminated.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+retrieve_directory_entry_content (const zim_archive_t *archive, const zim_directory_entry_t *entry, zim_blob_t *blob)
+{
+  int err = 0;
+
+  blob->cluster = get_cluster (archive, entry->cluster_number, entry->blob_number);
+  if (!blob->cluster)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't read cluster.\n");
+      goto cleanup;
+    }
+
+  err = cluster_blob (blob->cluster, entry->blob_number, &blob->data, &blob->len);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : retrieve_directory_entry_content() : can't find blob in cluster.\n");
+      goto cleanup;
+    }
+
+  cleanup:
+  if (err) release_blob (archive, blob);
+  return err;
+}
+
+/*
+ * Replace `entry` by the entry it redirects to, for as long as it's a
+ * redirect. Entries are read from `arena`, or the heap if it's NULL, like
+ * `entry` was.
+ *
+ * With `archive->redirect_targets`, the final entry is read right away.
+ * Otherwise, redirects are followed one at a time.
+ *
+ * Return non-zero in case of error, or if redirects loop or are too many.
+ */
+static int
+follow_redirects (const zim_archive_t *archive, zim_directory_entry_t *entry, arena_t *arena)
+{
+  if (entry->mime_type == MIME_TYPE_REDIRECT && archive->redirect_targets)
+    {
+      unsigned int target = archive->redirect_targets[entry->index];
+      if (target == REDIRECT_UNRESOLVED)
+        {
+          fprintf (stderr, "zim.c : follow_redirects() : redirect from %s is circular or broken.\n", entry->url);
+          return 1;
+        }
+
+      clear_zim_directory_entry (entry, arena);
+      stats_count (STATS_REDIRECTS, 1);
+      return read_directory_entry_at_index (archive, target, entry, arena);
+    }
+
+  for (int hops = 0; entry->mime_type == MIME_TYPE_REDIRECT; hops++)
+    {
+      if (hops == MAX_REDIRECTS)
+        {
+          fprintf (stderr, "zim.c : follow_redirects() : too many redirects from %s.\n", entry->url);
+          return 1;
+        }
+
+      size_t target = entry->redirect_index;
+      clear_zim_directory_entry (entry, arena);
+      stats_count (STATS_REDIRECTS, 1);
+
+      if (read_directory_entry_at_index (archive, target, entry, arena))
+        return 1;
+    }
+
+  return 0;
+}
+
+/*
+ * Read the position in the url pointer list of the entry at position `i` in
+ * the title pointer list.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_title_pointer (const zim_archive_t *archive, size_t i, size_t *url_index)
+{
+  unsigned int index = 0;
+
+  if (i >= archive->header->article_count)
+    {
+      fprintf (stderr, "zim.c : read_title_pointer() : there is no entry %zu.\n", i);
+      return 1;
+    }
+
+  if (read_int (archive, archive->header->title_ptr_pos + i * 4, 4, &index))
+    {
+      fprintf (stderr, "zim.c : read_title_pointer() : can't read title pointer.\n");
+      return 1;
+    }
+
+  *url_index = index;
+  return 0;
+}
+
+/*
+ * Sorted lists of directory entries : the url pointer list is sorted by
+ * namespace then url, the title pointer list by namespace then title.
+ * Entries without a title are sorted by their url in the latter.
+ */
+typedef enum {
+  URL_INDEX,
+  TITLE_INDEX,
+} zim_index_t;
+
+/*
+ * Read the entry at position `i` in `index`.
+ *
+ * You must allocate memory for `entry`. See parse_directory_entry() for
+ * `arena`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_directory_entry_in_index (const zim_archive_t *archive, zim_index_t index, size_t i, zim_directory_entry_t *entry, arena_t *arena)
+{
+  if (index == TITLE_INDEX && read_title_pointer (archive, i, &i))
+    return 1;
+
+  return read_directory_entry_at_index (archive, i, entry, arena);
+}
+
+/*
+ * Compare (`namespace`, `key`) with the sort key of `entry` in `index`.
+ *
+ * Only the first `key_len` bytes are compared : use strlen (key) + 1 for
+ * an exact match, strlen (key) to match `key` as a prefix.
+ */
+static int
+compare_index_key (zim_index_t index, char namespace, const char *key, size_t key_len, const zim_directory_entry_t *entry)
+{
+  if (namespace != entry->namespace)
+    return (unsigned char) namespace < (unsigned char) entry->namespace ? -1 : 1;
+
+  const char *entry_key = entry->url;
+  if (index == TITLE_INDEX && entry->title[0])
+    entry_key = entry->title;
+
+  return strncmp (key, entry_key, key_len);
+}
+
+/*
+ * Binary search in `index`, comparing with compare_index_key().
+ *
+ * `position` is set to the first entry which is not before (`namespace`,
+ * `key`), or with `upper`, to the first entry which is after it. It's set
+ * to the number of articles if there is none.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+search_index (const zim_archive_t *archive, zim_index_t index, char namespace, const char *key, size_t key_len, bool upper, size_t *position)
+{
+  size_t floor = 0;
+  size_t ceil = archive->header->article_count;
+  arena_t arena;
+  int err = 0;
+
+  arena_init (&arena, ENTRY_ARENA_BLOCK_SIZE);
+
+  while (floor < ceil)
+    {
+      size_t cut = floor + (ceil - floor) / 2;
+      zim_directory_entry_t entry = { 0 };
+
+      arena_reset (&arena);
+      if (read_directory_entry_in_index (archive, index, cut, &entry, &arena))
+        {
+          err = 1;
+          fprintf (stderr, "zim.c : search_index() : corrupted zimfile : can't parse entry.\n");
+          break;
+        }
+
+      int diff = compare_index_key (index, namespace, key, key_len, &entry);
+      if (diff > 0 || (upper && diff == 0))
+        floor = cut + 1;
+      else
+        ceil = cut;
+    }
+
+  arena_free (&arena);
+  *position = floor;
+  return err;
+}
+
+/*
+ * Find the entry whose key in `index` is exactly `key`.
+ *
+ * Keys are only unique within a namespace, and are given without it. Each
+ * namespace gets its own binary search, its boundaries being found by
+ * binary search too, and the first namespace with a match wins.
+ *
+ * You must allocate memory for `entry`. See parse_directory_entry() for
+ * `arena`.
+ *
+ * Return non-zero if there is no such entry, or in case of error.
+ */
+static int
+find_in_index (const zim_archive_t *archive, zim_index_t index, const char *key, zim_directory_entry_t *entry, arena_t *arena)
+{
+  size_t count = archive->header->article_count;
+  size_t namespace_start = 0;
+  size_t key_len = strlen (key) + 1;
+
+  while (namespace_start < count)
+    {
+      size_t i = 0;
+
+      if (read_directory_entry_in_index (archive, index, namespace_start, entry, arena))
+        return 1;
+
+      char namespace = entry->namespace;
+      clear_zim_directory_entry (entry, arena);
+
+      if (search_index (archive, index, namespace, key, key_len, false, &i))
+        return 1;
+
+      if (i < count)
+        {
+          if (read_directory_entry_in_index (archive, index, i, entry, arena))
+            return 1;
+
+          if (compare_index_key (index, namespace, key, key_len, entry) == 0)
+            return 0;
+
+          clear_zim_directory_entry (entry, arena);
+        }
+
+      if (search_index (archive, index, namespace, "", 0, true, &namespace_start))
+        return 1;
+    }
+
+  return 1;
+}
+
+/*
+ * Find the range of the url pointer list whose entries start with
+ * `prefix`, which is given with the namespace : "A/Foo" for urls starting
+ * with "Foo" in namespace A. "A" or "A/" is the whole namespace A.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+find_url_prefix_range (const zim_archive_t *archive, const char *prefix, zim_range_t *range)
+{
+  if (!prefix[0] || (prefix[1] && prefix[1] != '/'))
+    {
+      fprintf (stderr, "zim.c : find_url_prefix_range() : prefix must start with a namespace : %s\n", prefix);
+      return 1;
+    }
+
+  char namespace = prefix[0];
+  const char *url = prefix[1] ? prefix + 2 : "";
+  size_t len = strlen (url);
+
+  if (search_index (archive, URL_INDEX, namespace, url, len, false, &range->start)
+      || search_index (archive, URL_INDEX, namespace, url, len, true, &range->end))
+    return 1;
+
+  return 0;
+}
+
+/*
+ * Tell if `entry` passes `filter`, looking only at the fixed-size header
+ * of the entry. The size of its content is checked separately, see
+ * has_selected_size().
+ */
+static bool
+passes_filter (const zim_filter_t *filter, const zim_directory_entry_t *entry)
+{
+  bool has_content = entry->mime_type < filter->mime_types_count;
+
+  if (!filter->namespaces[(unsigned char) entry->namespace])
+    return false;
+
+  if (filter->mime_types && (!has_content || !filter->mime_types[entry->mime_type]))
+    return false;
+
+  if ((filter->min_size || filter->max_size) && !has_content)
+    return false;
+
+  return true;
+}
+
+/*
+ * Tell if the mime-type of `entry` is whitelisted, see compile_filter().
+ */
+static bool
+is_whitelisted (const zim_archive_t *archive, const zim_directory_entry_t *entry)
+{
+  const zim_filter_t *filter = &archive->filter;
+  return filter->whitelisted && entry->mime_type < filter->mime_types_count && filter->whitelisted[entry->mime_type];
+}
+
+/*
+ * Tell if the content of `entry` will be printed with the given options.
+ */
+static bool
+should_print_content (const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options)
+{
+  return options->show_article_content && is_whitelisted (archive, entry);
+}
+
+/*
+ * Weigh the clusters the articles of `selection` are read from, in
+ * `weights`, which has one item per cluster. Others weigh nothing, as no
+ * shard reads them.
+ *
+ * When content is printed, a cluster weighs its compressed size, times
+ * SHARD_DECOMPRESSION_WEIGHT unless it's stored uncompressed, where only
+ * reading it costs. Without content, clusters aren't read at all, and
+ * weigh the number of selected entries they hold instead.
+ *
+ * Entries are only checked on their fixed-size header, so a size filter is
+ * ignored here.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+weigh_shard_clusters (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_selection_t *selection, unsigned long long int *weights)
+{
+  const unsigned long int *ptrs = archive->cluster_ptrs;
+  size_t count = archive->header->cluster_count;
+  zim_directory_entry_t entry = { 0 };
+  unsigned long int pos = 0;
+
+  for (size_t i = selection->range.start; i < selection->range.end; i++)
+    {
+      entry.index = i;
+      if (read_url_pointer (archive, i, &pos) || parse_directory_entry_header (archive, &pos, &entry))
+        return 1;
+
+      if (entry.mime_type >= MIME_TYPE_DELETED || entry.cluster_number >= count || !passes_filter (selection->filter, &entry))
+        continue;
+
+      if (!should_print_content (archive, &entry, options))
+        {
+          if (!options->show_article_content)
+            weights[entry.cluster_number]++;
+          continue;
+        }
+
+      if (weights[entry.cluster_number] || ptrs[entry.cluster_number + 1] <= ptrs[entry.cluster_number])
+        continue;
+
+      unsigned char cluster_information = 0;
+      if (read_at (archive, ptrs[entry.cluster_number], 1, &cluster_information))
+        {
+          fprintf (stderr, "zim.c : weigh_shard_clusters() : can't read cluster information.\n");
+          return 1;
+        }
+
+      int compression = cluster_information & 0x0F;
+      unsigned long long int weight = ptrs[entry.cluster_number + 1] - ptrs[entry.cluster_number];
+      if (compression == COMPRESSION_XZ || compression == COMPRESSION_ZSTD)
+        weight *= SHARD_DECOMPRESSION_WEIGHT;
+      weights[entry.cluster_number] = weight;
+    }
+
+  return 0;
+}
+
+/*
+ * Find the clusters of shard `options->shard` out of
+ * `options->shards_count`. Clusters are split in contiguous runs of about
+ * the same weight, see weigh_shard_clusters(), each cut falling on the
+ * cluster boundary nearest to its share, so every cluster belongs to
+ * exactly one shard.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+find_shard_clusters (const zim_archive_t *archive, const zim_dump_options_t *options, zim_selection_t *selection)
+{
+  size_t count = archive->header->cluster_count;
+  unsigned long long int *weights = xalloc ((count + 1) * sizeof (unsigned long long int));
+
+  if (weigh_shard_clusters (archive, options, selection, weights))
+    {
+      free (weights);
+      return 1;
+    }
+
+  // weights[i] becomes the weight of the clusters before i
+  unsigned long long int total = 0;
+  for (size_t i = 0; i <= count; i++)
+    {
+      unsigned long long int weight = weights[i];
+      weights[i] = total;
+      total += weight;
+    }
+
+  size_t cuts[2];
+  for (size_t k = 0; k < 2; k++)
+    {
+      size_t shard = options->shard + k;
+      if (shard == 0 || shard == options->shards_count)
+        {
+          cuts[k] = shard ? count : 0;
+          continue;
+        }
+
+      unsigned long long int share = total / options->shards_count * shard + total % options->shards_count * shard / options->shards_count;
+      size_t i = 0;
+      while (i < count && weights[i] < share)
+        i++;
+      if (i > 0 && share - weights[i - 1] < weights[i] - share)
+        i--;
+      cuts[k] = i;
+    }
+
+  selection->clusters.start = cuts[0];
+  selection->clusters.end = cuts[1];
+  free (weights);
+  return 0;
+}
+
+/*
+ * Find which articles dump_all_articles() prints, following
+ * `options->url_prefix`, `options->range_start`, `options->range_end` and
+ * `options->shard`, along with the filter compiled by zim_parse().
+ *
+ * Articles with content are split between shards by cluster, see
+ * find_shard_clusters(), so no cluster is decompressed by two shards. The
+ * other ones are split by position in the selected range.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+select_articles (const zim_archive_t *archive, const zim_dump_options_t *options, zim_selection_t *selection)
+{
+  zim_range_t *range = &selection->range;
+
+  range->start = 0;
+  range->end = archive->header->article_count;
+  if (options->url_prefix && find_url_prefix_range (archive, options->url_prefix, range))
+    return 1;
+
+  if (options->range_start > range->start)
+    range->start = options->range_start;
+  if (options->range_end && options->range_end < range->end)
+    range->end = options->range_end;
+  if (range->start > range->end)
+    range->start = range->end;
+
+  selection->clusters = (zim_range_t) { 0, archive->header->cluster_count };
+  selection->entries = *range;
+  selection->filter = &archive->filter;
+
+  if (options->shards_count > 1)
+    {
+      size_t len = range->end - range->start;
+      selection->entries.start = range->start + len * options->shard / options->shards_count;
+      selection->entries.end = range->start + len * (options->shard + 1) / options->shards_count;
+      if (find_shard_clusters (archive, options, selection))
+        return 1;
+    }
+
+  return 0;
+}
+
+/*
+ * Tell if `entry` is part of `selection`, from its header only. Everything
+ * is when `selection` is NULL.
+ */
+static bool
+is_selected (const zim_selection_t *selection, const zim_directory_entry_t *entry)
+{
+  if (!selection)
+    return true;
+
+  if (entry->index < selection->range.start || entry->index >= selection->range.end)
+    return false;
+
+  if (selection->filter && !passes_filter (selection->filter, entry))
+    return false;
+
+  if (entry->mime_type < MIME_TYPE_DELETED)
+    return entry->cluster_number >= selection->clusters.start && entry->cluster_number < selection->clusters.end;
+
+  return entry->index >= selection->entries.start && entry->index < selection->entries.end;
+}
+
+/*
+ * Tell if the content of `entry` has a size accepted by the filter of
+ * `selection`, see read_blob_size(). Entries which can't be checked are
+ * skipped.
+ */
+static bool
+has_selected_size (const zim_archive_t *archive, const zim_selection_t *selection, const zim_directory_entry_t *entry)
+{
+  const zim_filter_t *filter = selection ? selection->filter : NULL;
+  size_t size = 0;
+
+  if (!filter || (!filter->min_size && !filter->max_size))
+    return true;
+
+  if (read_blob_size (archive, entry, &size))
+    return false;
+
+  return size >= filter->min_size && (!filter->max_size || size <= filter->max_size);
+}
+
+/*
+ * Read the entry at position `i` in the url pointer list if it's part of
+ * `selection`, setting `selected` accordingly.
+ *
+ * The fixed-size header of the entry is read first, and url and title are
+ * only read if it's selected. Otherwise, they're left NULL.
+ *
+ * You must allocate memory for `entry`. See parse_directory_entry() for
+ * `arena`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+read_selected_entry_at_index (const zim_archive_t *archive, const zim_selection_t *selection, size_t i, zim_directory_entry_t *entry, arena_t *arena, bool *selected)
+{
+  unsigned long int pos = 0;
+
+  if (read_url_pointer (archive, i, &pos))
+    return 1;
+
+  unsigned long long int started = stats_start ();
+  entry->index = i;
+  int err = parse_directory_entry_header (archive, &pos, entry);
+  stats_end (STATS_DIRECTORY, started);
+  stats_count (STATS_ENTRIES, 1);
+  if (err)
+    return 1;
+
+  *selected = is_selected (selection, entry) && has_selected_size (archive, selection, entry);
+  if (!*selected)
+    return 0;
+
+  started = stats_start ();
+  err = parse_directory_entry_strings (archive, pos, entry, arena);
+  stats_end (STATS_DIRECTORY, started);
+
+  return err;
+}
+
+/*
+ * Find the article whose key in `index` is `key`, following redirects. The
+ * entry is read in `entry`, which must be freed with
+ * free_zim_directory_entry().
+ *
+ * Return non-zero in case of error, or if the article has no content.
+ */
+static int
+find_article_in_index (zim_archive_t *archive, zim_index_t index, const char *key, zim_directory_entry_t *entry)
+{
+  int err = 0;
+
+  err = find_in_index (archive, index, key, entry, NULL);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : find_article_in_index() : can't find provided %s : %s\n", index == TITLE_INDEX ? "title" : "url", key);
+      return err;
+    }
+
+  err = follow_redirects (archive, entry, NULL);
+  if (err)
+    return err;
+
+  if (entry->mime_type == MIME_TYPE_REDLINK || entry->mime_type == MIME_TYPE_DELETED) // redlink or deleted page
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : find_article_in_index() : non-existing or deleted page.\n");
+    }
+
+  return err;
+}
+
+/*
+ * Find the article at a given url.
+ *
+ * There is no http request performed, the url is the name given
+ * to the record in the zimfile, coresponding to the path in the
+ * url of the article where is was fetched from the web.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+find_article_at_url (zim_archive_t *archive, const char *url, zim_directory_entry_t *entry)
+{
+  return find_article_in_index (archive, URL_INDEX, url, entry);
+}
+
+/*
+ * Find the article titled `title`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+find_article_at_title (zim_archive_t *archive, const char *title, zim_directory_entry_t *entry)
+{
+  return find_article_in_index (archive, TITLE_INDEX, title, entry);
+}
+
+/*
+ * Articles are printed on STDOUT through this buffer, see
+ * print_stream_header().
+ */
+static output_t standard_output;
+
+/*
+ * Scratch memory for what's read while printing an article on STDOUT, like
+ * the url of redirect targets. It's reset after each article.
+ */
+static arena_t output_arena;
+
+/*
+ * Progress of dump_all_articles(), saved in `path` every
+ * CHECKPOINT_INTERVAL seconds. Everything before `index` has been printed,
+ * `index` being a position in the url or title pointer list depending on
+ * `order`. In cluster order, articles with content come after all the
+ * others, and the ones stored in clusters before `cluster` have been
+ * printed as well.
+ *
+ * `offset` is the size of the output when the dump was resumed.
+ */
+typedef struct {
+  const char *path;
+  const char *order;
+  size_t index;
+  size_t cluster;
+  unsigned long long int offset;
+  time_t saved_at;
+} zim_checkpoint_t;
+
+static zim_checkpoint_t checkpoint;
+
+/*
+ * Write `len` bytes of article content on `out`. When it lies in the
+ * mapping of the zimfile (uncompressed clusters), it can be spliced from
+ * the file rather than copied.
+ */
+static void
+write_content (output_t *out, const zim_archive_t *archive, const char *content, size_t len)
+{
+  if (archive->map && content >= archive->map && content + len <= archive->map + archive->size)
+    output_write_from_file (out, content, archive->fd, content - archive->map, len);
+  else
+    output_write_ref (out, content, len);
+}
+
+/*
+ * Write the content of `entry` on `out` as it's decompressed, by chunks of
+ * STREAM_CHUNK_SIZE bytes, rather than decompressing its cluster in the
+ * cache first : memory use doesn't depend on the size of the blob nor of
+ * its cluster. Decompression stops at the end of the blob.
+ *
+ * Blobs of uncompressed clusters are written from the mapping of the
+ * zimfile, see write_content(), or read by chunks as well.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+stream_blob (const zim_archive_t *archive, const zim_directory_entry_t *entry, output_t *out)
+{
+  int err = 0;
+  char *chunk = NULL;
+  zim_cluster_stream_t *stream = NULL;
+  char offsets[16];
+  size_t produced = 0;
+  unsigned long int start = 0;
+  unsigned long int end = 0;
+  unsigned long int table_len = 0;
+  unsigned long int blob_start = 0;
+  unsigned long int blob_end = 0;
+  unsigned char cluster_information = 0;
+
+  err = read_cluster_position (archive, entry->cluster_number, &start, &end);
+  if (err)
+    goto cleanup;
+
+  if (end <= start || read_at (archive, start, 1, &cluster_information))
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : stream_blob() : can't read cluster information.\n");
+      goto cleanup;
+    }
+
+  int compression = cluster_information & 0x0F;
+  size_t offset_size = cluster_information & 0x10 ? 8 : 4;
+  size_t raw_len = end - start - 1;
+  size_t blob_pos = offset_size * entry->blob_number;
+  size_t decoded = blob_pos + 2 * offset_size;
+
+  if (compression == COMPRESSION_XZ || compression == COMPRESSION_ZSTD)
+    {
+      stream = open_cluster_stream (archive, start + 1, raw_len, compression);
+      if (!stream)
+        {
+          err = 1;
+          goto cleanup;
+        }
+
+      stats_count (compression == COMPRESSION_XZ ? STATS_XZ_CLUSTERS : STATS_ZSTD_CLUSTERS, 1);
+      stats_count (compression == COMPRESSION_XZ ? STATS_XZ_IN : STATS_ZSTD_IN, raw_len);
+      chunk = xalloc (STREAM_CHUNK_SIZE);
+
+      // the first offset is where the table ends, and the first blob starts
+      err = read_cluster_stream (stream, offsets, offset_size, &produced);
+      if (err)
+        goto cleanup;
+
+      read_int_from_buf (offsets, offset_size, &table_len);
+      if (decoded > table_len)
+        goto corrupted;
+
+      if (entry->blob_number == 0)
+        err = read_cluster_stream (stream, offsets + offset_size, offset_size, &produced);
+      else
+        err = skip_cluster_stream (stream, chunk, blob_pos - offset_size)
+          || read_cluster_stream (stream, offsets, 2 * offset_size, &produced);
+    }
+  else
+    {
+      stats_count (STATS_STORED_CLUSTERS, 1);
+      err = read_int (archive, start + 1, offset_size, &table_len);
+      if (err)
+        goto cleanup;
+
+      if (decoded > table_len)
+        goto corrupted;
+
+      err = read_at (archive, start + 1 + blob_pos, 2 * offset_size, offsets);
+    }
+
+  if (err)
+    goto cleanup;
+
+  read_int_from_buf (offsets, offset_size, &blob_start);
+  read_int_from_buf (offsets + offset_size, offset_size, &blob_end);
+  if (blob_start < decoded || blob_end < blob_start || (!stream && blob_end > raw_len))
+    goto corrupted;
+
+  if (!stream && archive->map)
+    {
+      stats_count (STATS_BYTES_READ, blob_end - blob_start);
+      write_content (out, archive, archive->map + start + 1 + blob_start, blob_end - blob_start);
+      goto cleanup;
+    }
+
+  if (stream)
+    err = skip_cluster_stream (stream, chunk, blob_start - decoded);
+  else
+    chunk = xalloc (STREAM_CHUNK_SIZE);
+
+  for (unsigned long int pos = blob_start; pos < blob_end && !err; pos += produced)
+    {
+      produced = blob_end - pos < STREAM_CHUNK_SIZE ? blob_end - pos : STREAM_CHUNK_SIZE;
+      if (stream)
+        err = read_cluster_stream (stream, chunk, produced, &produced);
+      else
+        err = read_at (archive, start + 1 + pos, produced, chunk);
+
+      if (!err)
+        output_write_ref (out, chunk, produced);
+    }
+
+  goto cleanup;
+
+  corrupted:
+  err = 1;
+  fprintf (stderr, "zim.c : stream_blob() : corrupted zimfile : invalid offsets for blob %u in cluster %u.\n", entry->blob_number, entry->cluster_number);
+
+  cleanup:
+  free_cluster_stream (stream);
+  if (chunk) free (chunk);
+  return err;
+}
+
+/*
+ * Read the url of the entry `entry` ends up at if it's a redirect, see
+ * resolve_redirects(). Only the header of the target entry is parsed, and
+ * its url is allocated from `arena`.
+ *
+ * Return NULL if it's not a redirect, if redirects were not resolved, or if
+ * this one is broken.
+ */
+static const char *
+read_redirect_target_url (const zim_archive_t *archive, const zim_directory_entry_t *entry, arena_t *arena)
+{
+  zim_directory_entry_t target = { 0 };
+  unsigned long int pos = 0;
+  size_t consumed = 0;
+  const char *url = NULL;
+
+  if (entry->mime_type != MIME_TYPE_REDIRECT || !archive->redirect_targets)
+    return NULL;
+
+  unsigned int target_index = archive->redirect_targets[entry->index];
+  if (target_index == REDIRECT_UNRESOLVED)
+    return NULL;
+
+  if (!read_url_pointer (archive, target_index, &pos) && !parse_directory_entry_header (archive, &pos, &target))
+    url = read_string_at (archive, pos, arena, &consumed);
+
+  if (!url)
+    fprintf (stderr, "zim.c : read_redirect_target_url() : can't read target of redirect %s.\n", entry->url);
+
+  return url;
+}
+
+/*
+ * Print a single article on `out`, in the text format documented in
+ * dump_all_articles().
+ */
+static void
+fprint_article_text (output_t *out, const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options, const char *content, size_t len, arena_t *arena)
+{
+  output_write_str (out, "<START_OF_ZIM_ARTICLE>\nurl: ");
+  output_write_str (out, entry->url);
+  output_write_str (out, "\ntitle: ");
+  output_write_str (out, entry->title);
+
+  if (entry->mime_type < archive->mime_type_list->len)
+    {
+      const char *mime_type = archive->mime_type_list->items[entry->mime_type];
+      output_write_str (out, "\nmime-type: ");
+      output_write_str (out, mime_type);
+      output_write_str (out, "\n");
+
+      if (options->show_article_content)
+        {
+          if (is_whitelisted (archive, entry))
+            {
+              output_write_str (out, "content:\n");
+              if (content)
+                {
+                  write_content (out, archive, content, len);
+                  output_write_str (out, "\n");
+                }
+              else
+                fprintf (stderr, "zim.c : fprint_article_text() : can't find content for this article.\n");
+            }
+          else
+            output_write_str (out, "content:\nNOT-WHITELISTED-MIME-TYPE\n");
+        }
+    }
+  else
+    {
+      switch (entry->mime_type)
+        {
+          case MIME_TYPE_REDIRECT:
+            output_write_str (out, "\nmime-type: none (redirect)\n");
+
+            const char *target = read_redirect_target_url (archive, entry, arena);
+            if (target)
+              {
+                output_write_str (out, "redirect-target: ");
+                output_write_str (out, target);
+                output_write_str (out, "\n");
+              }
+            break;
+
+          case MIME_TYPE_REDLINK:
+          case MIME_TYPE_DELETED:
+            output_write_str (out, "\nmime-type: none (deleted page)\n");
+            break;
+
+          default:
+            output_write_str (out, "\nmime-type: unknown\n");
+        }
+    }
+
+  output_write_str (out, "<END_OF_ZIM_ARTICLE>\n");
+}
+
+/*
+ * Print a single article on `out`, in the binary format : a fixed size
+ * header of BINARY_RECORD_HEADER_SIZE bytes followed by url, title,
+ * mime-type and content, none of them NUL terminated. Ints are little
+ * endian :
+ *
+ *   offset  size  field
+ *        0     4  index of the article in the url list
+ *        4     4  cluster number (0xffffffff for redirects and deleted pages)
+ *        8     4  blob number (same)
+ *       12     2  mime-type number, as found in the directory entry
+ *       14     1  namespace
+ *       15     1  flags : BINARY_FLAG_CONTENT if content is included,
+ *                 BINARY_FLAG_NOT_WHITELISTED if it's excluded by mime-type
+ *       16     4  url length
+ *       20     4  title length
+ *       24     4  mime-type length
+ *       28     8  content length
+ */
+static void
+fprint_article_binary (output_t *out, const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options, const char *content, size_t len)
+{
+  char header[BINARY_RECORD_HEADER_SIZE];
+  const char *mime_type = "";
+  bool has_blob = entry->mime_type < archive->mime_type_list->len;
+  unsigned char flags = 0;
+
+  if (has_blob)
+    {
+      mime_type = archive->mime_type_list->items[entry->mime_type];
+      if (options->show_article_content)
+        {
+          if (!is_whitelisted (archive, entry))
+            flags |= BINARY_FLAG_NOT_WHITELISTED;
+          else if (content)
+            flags |= BINARY_FLAG_CONTENT;
+          else
+            fprintf (stderr, "zim.c : fprint_article_binary() : can't find content for this article.\n");
+        }
+    }
+
+  if (!(flags & BINARY_FLAG_CONTENT))
+    len = 0;
+
+  size_t url_len = strlen (entry->url);
+  size_t title_len = strlen (entry->title);
+  size_t mime_type_len = strlen (mime_type);
+
+  write_int_to_buf (header, 4, entry->index);
+  write_int_to_buf (header + 4, 4, has_blob ? entry->cluster_number : 0xFFFFFFFF);
+  write_int_to_buf (header + 8, 4, has_blob ? entry->blob_number : 0xFFFFFFFF);
+  write_int_to_buf (header + 12, 2, entry->mime_type);
+  header[14] = entry->namespace;
+  header[15] = flags;
+  write_int_to_buf (header + 16, 4, url_len);
+  write_int_to_buf (header + 20, 4, title_len);
+  write_int_to_buf (header + 24, 4, mime_type_len);
+  write_int_to_buf (header + 28, 8, len);
+
+  output_write (out, header, sizeof (header));
+  output_write (out, entry->url, url_len);
+  output_write (out, entry->title, title_len);
+  output_write (out, mime_type, mime_type_len);
+  if (len) write_content (out, archive, content, len);
+}
+
+/*
+ * Tell if `mime_type` is for text : "text/...", XML and JSON types like
+ * "image/svg+xml", and javascript. Parameters like ";charset=UTF-8" are
+ * ignored.
+ */
+static bool
+is_text_mime_type (const char *mime_type)
+{
+  static const char *text_types[] = { "application/javascript", "application/json", "application/xml" };
+  size_t len = strcspn (mime_type, ";");
+
+  if (strncmp (mime_type, "text/", 5) == 0)
+    return true;
+
+  if ((len > 4 && strncmp (mime_type + len - 4, "+xml", 4) == 0)
+      || (len > 5 && strncmp (mime_type + len - 5, "+json", 5) == 0))
+    return true;
+
+  for (size_t i = 0; i < sizeof (text_types) / sizeof (*text_types); i++)
+    if (strlen (text_types[i]) == len && strncmp (mime_type, text_types[i], len) == 0)
+      return true;
+
+  return false;
+}
+
+/*
+ * Print a single article on `out` as a JSON object on its own line :
+ *
+ *   {"url":"...","title":"...","mime":"...","index":42,"content":"..."}
+ *
+ * `mime` is null for redirects and deleted pages. Redirects also have a
+ * `redirect` field, with the url of the article they end up at, when
+ * redirects are resolved and this one is not broken. `content` is only there
+ * when `options->show_article_content` is true and the article has a
+ * mime-type. It's null when the mime-type is not whitelisted or not text,
+ * see is_text_mime_type(), or the content can't be retrieved. Text which
+ * isn't valid UTF-8 is fixed, see output_write_json_string().
+ */
+static void
+fprint_article_json (output_t *out, const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options, const char *content, size_t len, arena_t *arena)
+{
+  output_write_str (out, "{\"url\":");
+  output_write_json_string (out, entry->url, strlen (entry->url));
+  output_write_str (out, ",\"title\":");
+  output_write_json_string (out, entry->title, strlen (entry->title));
+  output_write_str (out, ",\"mime\":");
+
+  if (entry->mime_type >= archive->mime_type_list->len)
+    {
+      output_write_str (out, "null,\"index\":");
+      output_write_uint (out, entry->index);
+
+      const char *target = read_redirect_target_url (archive, entry, arena);
+      if (target)
+        {
+          output_write_str (out, ",\"redirect\":");
+          output_write_json_string (out, target, strlen (target));
+        }
+
+      output_write_str (out, "}\n");
+      return;
+    }
+
+  const char *mime_type = archive->mime_type_list->items[entry->mime_type];
+  output_write_json_string (out, mime_type, strlen (mime_type));
+  output_write_str (out, ",\"index\":");
+  output_write_uint (out, entry->index);
+
+  if (options->show_article_content)
+    {
+      output_write_str (out, ",\"content\":");
+      if (content && is_whitelisted (archive, entry) && is_text_mime_type (mime_type))
+        output_write_json_string (out, content, len);
+      else
+        output_write_str (out, "null");
+    }
+
+  output_write_str (out, "}\n");
+}
+
+/*
+ * Print a single article on `out`, in the format chosen with
+ * `options->format`.
+ *
+ * `content` is only used when should_print_content() is true for `entry`.
+ * A NULL `content` means it could not be retrieved. What's read to print
+ * the article, like the url of a redirect target, is allocated from
+ * `arena`.
+ */
+static void
+fprint_article (output_t *out, const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options, const char *content, size_t len, arena_t *arena)
+{
+  if (options->format == ZIM_FORMAT_BINARY)
+    fprint_article_binary (out, archive, entry, options, content, len);
+  else if (options->format == ZIM_FORMAT_JSONL)
+    fprint_article_json (out, archive, entry, options, content, len, arena);
+  else
+    fprint_article_text (out, archive, entry, options, content, len, arena);
+}
+
+/*
+ * Start printing articles on STDOUT, with what comes before the first one
+ * depending on the format.
+ */
+static void
+print_stream_header (const zim_dump_options_t *options)
+{
+  output_init (&standard_output, STDOUT_FILENO);
+  arena_init (&output_arena, ENTRY_ARENA_BLOCK_SIZE);
+
+  if (options->format == ZIM_FORMAT_BINARY && checkpoint.offset == 0)
+    output_write (&standard_output, BINARY_STREAM_MAGIC, sizeof (BINARY_STREAM_MAGIC) - 1);
+}
+
+/*
+ * Print a single article on STDOUT, see fprint_article().
+ */
+static void
+print_article (const zim_archive_t *archive, const zim_directory_entry_t *entry, const zim_dump_options_t *options, const char *content, size_t len)
+{
+  fprint_article (&standard_output, archive, entry, options, content, len, &output_arena);
+  arena_reset (&output_arena);
+  stats_count (STATS_ARTICLES, 1);
+  stats_progress ();
+}
+
+/*
+ * Write what's left of articles printed since print_stream_header().
+ *
+ * Return non-zero if the output could not be written.
+ */
+static int
+print_stream_end (void)
+{
+  if (!standard_output.buf)
+    return 0;
+
+  arena_free (&output_arena);
+  return output_close (&standard_output);
+}
+
+/*
+ * Order in which dump_all_articles() prints articles, as written in
+ * checkpoints.
+ */
+static const char *
+dump_order (const zim_dump_options_t *options)
+{
+  if (options->title_order)
+    return "title";
+
+  if (options->cluster_order && options->show_article_content && !options->reorder_window)
+    return "cluster";
+
+  return "url";
+}
+
+/*
+ * Resume from the checkpoint at `options->checkpoint_path` if
+ * `options->resume` is true and it exists.
+ *
+ * If STDOUT is a regular file, it's truncated to its size at the time of
+ * the checkpoint, so articles printed afterward are not repeated and the
+ * last one is not left incomplete.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+load_checkpoint (const zim_dump_options_t *options)
+{
+  char order[16] = { 0 };
+  struct stat st;
+
+  checkpoint = (zim_checkpoint_t) { 0 };
+  checkpoint.path = options->checkpoint_path;
+  checkpoint.order = dump_order (options);
+  checkpoint.saved_at = time (NULL);
+
+  if (!checkpoint.path || !options->resume)
+    return 0;
+
+  FILE *file = fopen (checkpoint.path, "r");
+  if (!file)
+    return 0;
+
+  int read = fscanf (file, "zim_dump checkpoint\norder %15s\nindex %zu\ncluster %zu\noffset %llu\n", order, &checkpoint.index, &checkpoint.cluster, &checkpoint.offset);
+  fclose (file);
+
+  if (read != 4)
+    {
+      fprintf (stderr, "zim.c : load_checkpoint() : malformed checkpoint : %s\n", checkpoint.path);
+      return 1;
+    }
+
+  if (strcmp (order, checkpoint.order) != 0)
+    {
+      fprintf (stderr, "zim.c : load_checkpoint() : checkpoint was made in %s order, not %s order.\n", order, checkpoint.order);
+      return 1;
+    }
+
+  if (fstat (STDOUT_FILENO, &st) == 0 && S_ISREG (st.st_mode))
+    {
+      if ((unsigned long long int) st.st_size < checkpoint.offset)
+        {
+          fprintf (stderr, "zim.c : load_checkpoint() : output is smaller than at the time of the checkpoint. Append to it with `>>`.\n");
+          return 1;
+        }
+
+      if (ftruncate (STDOUT_FILENO, checkpoint.offset) == -1 || lseek (STDOUT_FILENO, checkpoint.offset, SEEK_SET) == -1)
+        {
+          fprintf (stderr, "zim.c : load_checkpoint() : can't truncate output : %s\n", strerror (errno));
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Write the checkpoint, once everything printed so far is out.
+ *
+ * It's written in a temporary file first, which is then renamed, so a
+ * crash never leaves a partial checkpoint.
+ */
+static void
+write_checkpoint (void)
+{
+  struct stat st;
+  char *tmp_path = NULL;
+  FILE *file = NULL;
+
+  checkpoint.saved_at = time (NULL);
+
+  if (output_flush (&standard_output))
+    return;
+
+  if (fstat (STDOUT_FILENO, &st) == 0 && S_ISREG (st.st_mode))
+    fdatasync (STDOUT_FILENO);
+
+  tmp_path = xalloc (strlen (checkpoint.path) + 5);
+  sprintf (tmp_path, "%s.tmp", checkpoint.path);
+
+  file = fopen (tmp_path, "w");
+  if (!file)
+    goto error;
+
+  fprintf (file, "zim_dump checkpoint\norder %s\nindex %zu\ncluster %zu\noffset %llu\n", checkpoint.order, checkpoint.index, checkpoint.cluster, checkpoint.offset + standard_output.written);
+
+  if (fflush (file) != 0 || fsync (fileno (file)) == -1)
+    goto error;
+
+  fclose (file);
+  file = NULL;
+
+  if (rename (tmp_path, checkpoint.path) == -1)
+    goto error;
+
+  free (tmp_path);
+  return;
+
+  error:
+  fprintf (stderr, "zim.c : write_checkpoint() : can't write checkpoint %s : %s\n", checkpoint.path, strerror (errno));
+  if (file) fclose (file);
+  free (tmp_path);
+}
+
+/*
+ * Note that everything before position `index` has been printed, and write
+ * the checkpoint if it's due.
+ */
+static void
+save_progress (size_t index)
+{
+  if (!checkpoint.path || index < checkpoint.index)
+    return;
+
+  checkpoint.index = index;
+  if (time (NULL) - checkpoint.saved_at >= CHECKPOINT_INTERVAL)
+    write_checkpoint ();
+}
+
+/*
+ * Note that, in cluster order, articles stored in clusters before `cluster`
+ * have been printed, and write the checkpoint if it's due.
+ */
+static void
+save_cluster_progress (size_t cluster)
+{
+  if (!checkpoint.path || cluster <= checkpoint.cluster)
+    return;
+
+  checkpoint.cluster = cluster;
+  if (time (NULL) - checkpoint.saved_at >= CHECKPOINT_INTERVAL)
+    write_checkpoint ();
+}
+
+/*
+ * Write the checkpoint of a completed dump : resuming it prints nothing.
+ */
+static void
+finish_checkpoint (const zim_archive_t *archive)
+{
+  if (!checkpoint.path)
+    return;
+
+  checkpoint.index = archive->header->article_count;
+  checkpoint.cluster = archive->header->cluster_count;
+  write_checkpoint ();
+}
+
+/*
+ * An article going through the pipeline of dump_articles_in_parallel().
+ *
+ * `done` is set by workers once `content` is ready for printing. The
+ * cluster holding it stays pinned in cache until the writer is done.
+ * `position` is where the entry was read, see dump_articles_in_parallel().
+ */
+typedef struct {
+  size_t position;
+  zim_directory_entry_t *entry;
+  bool with_content;
+  zim_blob_t content;
+  bool done;
+} zim_dump_job_t;
+
+typedef struct {
+  const zim_archive_t *archive;
+  const zim_dump_options_t *options;
+  queue_t work;
+  queue_t output;
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+} zim_dump_pipeline_t;
+
+/*
+ * Decompression stage : retrieve content for jobs of the work queue.
+ */
+static void *
+run_dump_worker (void *data)
+{
+  zim_dump_pipeline_t *pipeline = data;
+  zim_dump_job_t *job = NULL;
+
+  while ((job = queue_pop (&pipeline->work)))
+    {
+      retrieve_directory_entry_content (pipeline->archive, job->entry, &job->content);
+
+      pthread_mutex_lock (&pipeline->lock);
+      job->done = true;
+      pthread_cond_broadcast (&pipeline->job_done);
+      pthread_mutex_unlock (&pipeline->lock);
+    }
+
+  return NULL;
+}
+
+/*
+ * Writer stage : print jobs in the order they were read, as soon as they're
+ * done.
+ */
+static void *
+run_dump_writer (void *data)
+{
+  zim_dump_pipeline_t *pipeline = data;
+  zim_dump_job_t *job = NULL;
+
+  while ((job = queue_pop (&pipeline->output)))
+    {
+      pthread_mutex_lock (&pipeline->lock);
+      while (!job->done)
+        pthread_cond_wait (&pipeline->job_done, &pipeline->lock);
+      pthread_mutex_unlock (&pipeline->lock);
+
+      if (pipeline->options->cluster_order)
+        save_cluster_progress (job->entry->cluster_number);
+      else
+        save_progress (job->position);
+
+      print_article (pipeline->archive, job->entry, pipeline->options, job->content.data, job->content.len);
+
+      release_blob (pipeline->archive, &job->content);
+      free_zim_directory_entry (job->entry);
+      free (job);
+    }
+
+  return NULL;
+}
+
+/*
+ * Multi-threaded version of the dump loop, using `options->jobs`
+ * decompression threads.
+ *
+ * The calling thread reads directory entries and pushes them in two bounded
+ * queues : one for decompression workers, and one for a single writer
+ * thread, which prints articles in the order they were read. Articles are
+ * read at positions `range` of `refs` if provided, or of the url pointer
+ * list otherwise, and skipped if they're not in `selection`.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+dump_articles_in_parallel (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_blob_ref_t *refs, zim_range_t range, const zim_selection_t *selection)
+{
+  int err = 0;
+  size_t workers_count = 0;
+  pthread_t *workers = xalloc (options->jobs * sizeof (*workers));
+  pthread_t writer;
+  bool writer_started = false;
+  zim_dump_pipeline_t pipeline = { 0 };
+
+  pipeline.archive = archive;
+  pipeline.options = options;
+  queue_init (&pipeline.work, options->jobs * PIPELINE_JOBS_PER_WORKER);
+  queue_init (&pipeline.output, options->jobs * PIPELINE_JOBS_PER_WORKER);
+  pthread_mutex_init (&pipeline.lock, NULL);
+  pthread_cond_init (&pipeline.job_done, NULL);
+
+  for (size_t i = 0; i < options->jobs; i++)
+    {
+      if (pthread_create (&workers[workers_count], NULL, run_dump_worker, &pipeline) != 0)
+        {
+          fprintf (stderr, "zim.c : dump_articles_in_parallel() : can't start worker thread.\n");
+          break;
+        }
+      workers_count++;
+    }
+
+  if (workers_count == 0 || pthread_create (&writer, NULL, run_dump_writer, &pipeline) != 0)
+    {
+      err = 1;
+      fprintf (stderr, "zim.c : dump_articles_in_parallel() : can't start threads.\n");
+      goto cleanup;
+    }
+  writer_started = true;
+
+  for (size_t i = range.start; i < range.end; i++)
+    {
+      size_t index = refs ? refs[i].index : i;
+      zim_dump_job_t *job = xalloc (sizeof (*job));
+      job->position = i;
+      job->content = (zim_blob_t) { 0 };
+      job->entry = xalloc (sizeof (*job->entry));
+
+      bool selected = false;
+      if (read_selected_entry_at_index (archive, selection, index, job->entry, NULL, &selected))
+        fprintf (stderr, "zim.c : dump_articles_in_parallel() : bogus entry found. Ignoring.\n");
+
+      if (!selected)
+        {
+          free_zim_directory_entry (job->entry);
+          free (job);
+          continue;
+        }
+
+      bool with_content = should_print_content (archive, job->entry, options);
+      job->with_content = with_content;
+      job->done = !with_content;
+
+      // job belongs to the writer as soon as it's in the output queue
+      if (with_content)
+        queue_push (&pipeline.work, job);
+      queue_push (&pipeline.output, job);
+    }
+
+  cleanup:
+  queue_close (&pipeline.work);
+  queue_close (&pipeline.output);
+  for (size_t i = 0; i < workers_count; i++)
+    pthread_join (workers[i], NULL);
+  if (writer_started) pthread_join (writer, NULL);
+
+  queue_destroy (&pipeline.work);
+  queue_destroy (&pipeline.output);
+  pthread_mutex_destroy (&pipeline.lock);
+  pthread_cond_destroy (&pipeline.job_done);
+  free (workers);
+  return err;
+}
+
+static int
+compare_blob_refs (const void *a, const void *b)
+{
+  const zim_blob_ref_t *ref_a = a;
+  const zim_blob_ref_t *ref_b = b;
+
+  if (ref_a->cluster_number != ref_b->cluster_number)
+    return ref_a->cluster_number < ref_b->cluster_number ? -1 : 1;
+
+  if (ref_a->blob_number != ref_b->blob_number)
+    return ref_a->blob_number < ref_b->blob_number ? -1 : 1;
+
+  return ref_a->index < ref_b->index ? -1 : ref_a->index > ref_b->index;
+}
+
+/*
+ * Called for each blob by for_each_blob_in_cluster_order().
+ *
+ * `blob` is NULL if the blob could not be retrieved.
+ */
+typedef void (*blob_handler_t) (const zim_blob_ref_t *ref, const char *blob, size_t len, void *data);
+
+/*
+ * Call `handler` for each blob referenced in `refs`, decompressing each
+ * cluster only once.
+ *
+ * `refs` must be sorted with compare_blob_refs().
+ */
+static void
+for_each_blob_in_cluster_order (const zim_archive_t *archive, const zim_blob_ref_t *refs, size_t refs_count, blob_handler_t handler, void *data)
+{
+  const zim_cluster_t *cluster = NULL;
+
+  for (size_t i = 0; i < refs_count; i++)
+    {
+      const zim_blob_ref_t *ref = &refs[i];
+      const char *blob = NULL;
+      size_t len = 0;
+
+      if (i == 0 || ref->cluster_number != refs[i - 1].cluster_number)
+        {
+          // refs are sorted, so the last one of the cluster is the furthest
+          size_t last = i;
+          while (last + 1 < refs_count && refs[last + 1].cluster_number == ref->cluster_number)
+            last++;
+
+          if (cluster) release_cluster (archive, cluster);
+          cluster = get_cluster (archive, ref->cluster_number, refs[last].blob_number);
+          if (!cluster)
+            fprintf (stderr, "zim.c : for_each_blob_in_cluster_order() : can't read cluster %u.\n", ref->cluster_number);
+        }
+
+      if (cluster && cluster_blob (cluster, ref->blob_number, &blob, &len))
+        blob = NULL;
+
+      handler (ref, blob, len, data);
+    }
+
+  if (cluster) release_cluster (archive, cluster);
+}
+
+typedef struct {
+  const zim_archive_t *archive;
+  const zim_dump_options_t *options;
+  arena_t arena;
+} cluster_order_printer_t;
+
+/*
+ * blob_handler_t printing the article right away.
+ */
+static void
+print_blob_article (const zim_blob_ref_t *ref, const char *blob, size_t len, void *data)
+{
+  cluster_order_printer_t *printer = data;
+  zim_directory_entry_t entry = { 0 };
+
+  save_cluster_progress (ref->cluster_number);
+
+  arena_reset (&printer->arena);
+  if (read_directory_entry_at_index (printer->archive, ref->index, &entry, &printer->arena))
+    fprintf (stderr, "zim.c : print_blob_article() : bogus entry found. Ignoring.\n");
+  else
+    print_article (printer->archive, &entry, printer->options, blob, len);
+}
+
+/*
+ * Cluster ordered version of dump_all_articles().
+ *
+ * Articles without content to print are printed in url order while
+ * gathering the position of the other ones, which are then printed in the
+ * order of their clusters so each cluster is only decompressed once.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+dump_articles_in_cluster_order (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_selection_t *selection)
+{
+  zim_range_t range = selection->range;
+  size_t refs_count = 0;
+  zim_blob_ref_t *refs = xalloc ((range.end - range.start + 1) * sizeof (*refs));
+  cluster_order_printer_t printer = { .archive = archive, .options = options };
+
+  arena_init (&printer.arena, ENTRY_ARENA_BLOCK_SIZE);
+
+  for (size_t i = range.start; i < range.end; i++)
+    {
+      save_progress (i);
+
+      zim_directory_entry_t entry = { 0 };
+      bool selected = false;
+      arena_reset (&printer.arena);
+      if (read_selected_entry_at_index (archive, selection, i, &entry, &printer.arena, &selected))
+        {
+          fprintf (stderr, "zim.c : dump_articles_in_cluster_order() : bogus entry found. Ignoring.\n");
+          continue;
+        }
+
+      if (!selected)
+        continue;
+
+      if (should_print_content (archive, &entry, options))
+        {
+          if (entry.cluster_number >= checkpoint.cluster)
+            {
+              refs[refs_count].cluster_number = entry.cluster_number;
+              refs[refs_count].blob_number = entry.blob_number;
+              refs[refs_count].index = i;
+              refs_count++;
+            }
+        }
+      else if (i >= checkpoint.index)
+        print_article (archive, &entry, options, NULL, 0);
+    }
+
+  save_progress (range.end);
+
+  qsort (refs, refs_count, sizeof (*refs), compare_blob_refs);
+
+  int err = 0;
+  if (options->jobs > 1)
+    err = dump_articles_in_parallel (archive, options, refs, (zim_range_t) { 0, refs_count }, NULL);
+  else
+    for_each_blob_in_cluster_order (archive, refs, refs_count, print_blob_article, &printer);
+
+  arena_free (&printer.arena);
+  free (refs);
+  return err;
+}
+
+/*
+ * Articles printed together by flush_reorder_window(), in the order they
+ * were added, along with a copy of their content.
+ *
+ * Entries and copies are allocated from `arena`, which is reset once the
+ * window is printed.
+ */
+typedef struct {
+  size_t size;
+  size_t len;
+  zim_directory_entry_t **entries;
+  zim_blob_ref_t *refs;
+  char **contents;
+  size_t *lens;
+  arena_t arena;
+} reorder_window_t;
+
+static void
+init_reorder_window (reorder_window_t *window, size_t size)
+{
+  window->size = size;
+  window->len = 0;
+  arena_init (&window->arena, ENTRY_ARENA_BLOCK_SIZE);
+  window->entries = xalloc (size * sizeof (*window->entries));
+  window->refs = xalloc (size * sizeof (*window->refs));
+  window->contents = xalloc (size * sizeof (*window->contents));
+  window->lens = xalloc (size * sizeof (*window->lens));
+}
+
+static void
+free_reorder_window (reorder_window_t *window)
+{
+  free (window->entries);
+  free (window->refs);
+  free (window->contents);
+  free (window->lens);
+  arena_free (&window->arena);
+}
+
+/*
+ * blob_handler_t keeping a copy of the blob until the window is flushed.
+ */
+static void
+store_blob_in_window (const zim_blob_ref_t *ref, const char *blob, size_t len, void *data)
+{
+  reorder_window_t *window = data;
+  size_t slot = ref->index;
+
+  if (!blob) return;
+
+  window->contents[slot] = arena_alloc (&window->arena, len);
+  memcpy (window->contents[slot], blob, len);
+  window->lens[slot] = len;
+}
+
+/*
+ * Print articles of the window in the order they were added, then empty
+ * it. The clusters they need are decompressed first, once each, in cluster
+ * order.
+ *
+ * NULL entries are skipped.
+ */
+static void
+flush_reorder_window (const zim_archive_t *archive, const zim_dump_options_t *options, reorder_window_t *window)
+{
+  size_t refs_count = 0;
+
+  for (size_t i = 0; i < window->len; i++)
+    {
+      zim_directory_entry_t *entry = window->entries[i];
+      if (entry && should_print_content (archive, entry, options))
+        {
+          window->refs[refs_count].cluster_number = entry->cluster_number;
+          window->refs[refs_count].blob_number = entry->blob_number;
+          window->refs[refs_count].index = i;
+          refs_count++;
+        }
+    }
+
+  qsort (window->refs, refs_count, sizeof (*window->refs), compare_blob_refs);
+  for_each_blob_in_cluster_order (archive, window->refs, refs_count, store_blob_in_window, window);
+
+  for (size_t i = 0; i < window->len; i++)
+    {
+      if (window->entries[i])
+        print_article (archive, window->entries[i], options, window->contents[i], window->lens[i]);
+
+      window->entries[i] = NULL;
+      window->contents[i] = NULL;
+      window->lens[i] = 0;
+    }
+
+  window->len = 0;
+  arena_reset (&window->arena);
+}
+
+/*
+ * Url ordered version of dump_articles_in_cluster_order().
+ *
+ * Articles are processed by windows of `options->reorder_window` entries :
+ * clusters needed by a window are decompressed once in cluster order, and
+ * the window is then printed in url order. Memory usage is bounded by the
+ * size of the window.
+ *
+ * Return non-zero in case of error.
+ */
+static int
+dump_articles_in_url_windows (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_selection_t *selection)
+{
+  reorder_window_t window = { 0 };
+  init_reorder_window (&window, options->reorder_window);
+
+  for (size_t i = selection->range.start; i < selection->range.end; i++)
+    {
+      zim_directory_entry_t *entry = new_zim_directory_entry (&window.arena);
+      bool selected = false;
+      if (read_selected_entry_at_index (archive, selection, i, entry, &window.arena, &selected))
+        {
+          fprintf (stderr, "zim.c : dump_articles_in_url_windows() : bogus entry found. Ignoring.\n");
+          entry = NULL;
+        }
+      else if (!selected)
+        continue;
+
+      window.entries[window.len++] = entry;
+      if (window.len == window.size)
+        {
+          flush_reorder_window (archive, options, &window);
+          save_progress (i + 1);
+        }
+    }
+
+  flush_reorder_window (archive, options, &window);
+  free_reorder_window (&window);
+  return 0;
+}
+
+/*
+ * Reader going front to back through a region of the zimfile.
+ *
+ * When the zimfile is mapped, views point directly into the mapping.
+ * Otherwise, it's read in `buf` by chunks of at least SCAN_CHUNK_SIZE
+ * bytes, starting at position `start`.
+ */
+typedef struct {
+  const zim_archive_t *archive;
+  char *buf;
+  size_t capacity;
+  unsigned long int start;
+  size_t len;
+} zim_scanner_t;
+
+/*
+ * Get a view on at least `min_len` bytes at `pos`. `avail` is set to the
+ * number of bytes readable from the view, which stays valid until the next
+ * call.
+ *
+ * Return NULL in case of error.
+ */
+static const char *
+scan_at (zim_scanner_t *scanner, unsigned long int pos, size_t min_len, size_t *avail)
+{
+  const zim_archive_t *archive = scanner->archive;
+
+  if (pos > archive->size || min_len > archive->size - pos)
+    {
+      fprintf (stderr, "zim.c : scan_at() : corrupted zimfile : trying to read after end of file.\n");
+      return NULL;
+    }
+
+  if (archive->map)
+    {
+      *avail = archive->size - pos;
+      return archive->map + pos;
+    }
+
+  if (pos < scanner->start || pos + min_len > scanner->start + scanner->len)
+    {
+      size_t len = min_len > SCAN_CHUNK_SIZE ? min_len : SCAN_CHUNK_SIZE;
+      if (len > archive->size - pos)
+        len = archive->size - pos;
+
+      if (len > scanner->capacity)
+        {
+          scanner->buf = xrealloc (scanner->buf, len);
+          scanner->capacity = len;
+        }
+
+      if (read_at (archive, pos, len, scanner->buf))
+        return NULL;
+
+      scanner->start = pos;
+      scanner->len = len;
+    }
+
+  *avail = scanner->start + scanner->len - pos;
+  return scanner->buf + (pos - scanner->start);
+}
+
+/*
+ * Parse the directory entry at `pos` in place.
+ *
+ * `entry->url` and `entry->title` point inside the scanner view rather than
+ * being copies : they're only valid until the next call, and `entry` must
+ * not be freed with free_zim_directory_entry().
+ *
+ * Return non-zero in case of error.
+ */
+static int
+scan_directory_entry (zim_scanner_t *scanner, unsigned long int pos, zim_directory_entry_t *entry)
+{
+  size_t avail = 0;
+  size_t need = 16;
+  size_t remaining = pos < scanner->archive->size ? scanner->archive->size - pos : 0;
+
+  while (true)
+    {
+      const char *buf = scan_at (scanner, pos, need < remaining ? need : remaining, &avail);
+      if (!buf)
+        return 1;
+
+      if (avail < 12)
+        {
+          fprintf (stderr, "zim.c : scan_directory_entry() : corrupted zimfile : truncated entry.\n");
+          return 1;
+        }
+
+      read_int_from_buf (buf, 2, &entry->mime_type);
+      size_t header_len = entry->mime_type == MIME_TYPE_REDIRECT ? 12 : 16;
+      if (avail < header_len)
+        {
+          fprintf (stderr, "zim.c : scan_directory_entry() : corrupted zimfile : truncated entry.\n");
+          return 1;
+        }
+
+      const char *url_end = memchr (buf + header_len, 0, avail - header_len);
+      const char *title_end = url_end ? memchr (url_end + 1, 0, buf + avail - url_end - 1) : NULL;
+
+      if (title_end)
+        {
+          entry->namespace = buf[3];
+          read_int_from_buf (buf + 4, 4, &entry->revision);
+          if (entry->mime_type == MIME_TYPE_REDIRECT)
+            read_int_from_buf (buf + 8, 4, &entry->redirect_index);
+          else
+            {
+              read_int_from_buf (buf + 8, 4, &entry->cluster_number);
+              read_int_from_buf (buf + 12, 4, &entry->blob_number);
+            }
+
+          entry->url = (char *) buf + header_len;
+          entry->title = (char *) url_end + 1;
+          if (scanner->archive->map)
+            stats_count (STATS_BYTES_READ, title_end + 1 - buf);
+
+          return 0;
+        }
+
+      if (avail >= remaining)
+        {
+          fprintf (stderr, "zim.c : scan_directory_entry() : corrupted zimfile : unterminated url or title.\n");
+          return 1;
+        }
+
+      need = avail + SCAN_CHUNK_SIZE;
+    }
+}
+
+/*
+ * Print urls, titles and mime-types of all articles by reading directory
+ * entries front to back, rather than seeking to each of them.
+ *
+ * This requires the url pointer list to be loaded, and only works when it's
+ * sorted by position, which is how zimfiles are usually written : entries
+ * are then stored in url order. Positions are still taken from the list, so
+ * gaps between entries don't matter.
+ *
+ * Return non-zero if entries are not stored in url order, in which case
+ * nothing has been printed.
+ */
+static int
+dump_entries_sequentially (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_selection_t *selection)
+{
+  zim_range_t range = selection->range;
+  const unsigned long int *ptrs = archive->url_ptrs + range.start;
+  size_t count = range.end - range.start;
+  zim_scanner_t scanner = { .archive = archive };
+
+  if (!archive->url_ptrs || count == 0)
+    return 1;
+
+  for (size_t i = 1; i < count; i++)
+    if (ptrs[i] <= ptrs[i - 1])
+      return 1;
 
-  file = fopen (archive->path, "r");
-  if (!file)
+  unsigned long int first = ptrs[0];
+  unsigned long int last = ptrs[count - 1];
+  if (archive->map && last < archive->size)
     {
-      fprintf (stderr, "zim.c : read_article_at_url() : can't open archive file.\n");
-      goto cleanup;
+      unsigned long int page = sysconf (_SC_PAGESIZE);
+      unsigned long int start = first - first % page;
+      madvise ((void *) (archive->map + start), last - start, MADV_SEQUENTIAL);
     }
+  else
+    posix_fadvise (archive->fd, first, last - first, POSIX_FADV_SEQUENTIAL);
 
-  unsigned long int floor = 0;
-  unsigned long int ceil = archive->header->article_count;
-
-  while (true)
+  for (size_t i = 0; i < count; i++)
     {
-      unsigned long int cut = floor + (ceil - floor) / 2;
-      if (floor == cut) break;
-      if (fseek (file, archive->header->url_ptr_pos + cut * 8, SEEK_SET) == -1)
-        {
-          fprintf (stderr, "zim.c : read_article_at_url() : can't use file anymore.\n");
-          goto cleanup;
-        }
-
-      int err = read_int (file, 8, &dir_entry);
-      if (err)
-        {
-          fprintf (stderr, "zim.c : read_article_at_url() : can't read anymore.\n");
-          goto cleanup;
-        }
+      save_progress (range.start + i);
 
-      if (fseek (file, dir_entry, SEEK_SET) == -1)
-        {
-          fprintf (stderr, "zim.c : read_article_at_url() : can't use file anymore.\n");
-          goto cleanup;
-        }
+      zim_directory_entry_t entry = { .index = range.start + i };
+      unsigned long long int started = stats_start ();
+      int err = scan_directory_entry (&scanner, ptrs[i], &entry);
+      stats_end (STATS_DIRECTORY, started);
+      stats_count (STATS_ENTRIES, 1);
 
-      entry = xalloc (sizeof (*entry));
-      err = parse_directory_entry (file, entry);
       if (err)
         {
-          fprintf (stderr, "zim.c : read_article_at_url() : corrupted zimfile : can't parse entry.\n");
-          goto cleanup;
+          fprintf (stderr, "zim.c : dump_entries_sequentially() : bogus entry found. Ignoring.\n");
+          continue;
         }
 
-      int diff = strncmp (url, entry->url, strlen (url));
+      if (is_selected (selection, &entry) && has_selected_size (archive, selection, &entry))
+        print_article (archive, &entry, options, NULL, 0);
+    }
 
-      if (diff == 0)
-        break;
-      else
-        {
-          if (diff < 0) ceil = cut;
-          else floor = cut;
+  if (scanner.buf) free (scanner.buf);
+  return 0;
+}
 
-          free_zim_directory_entry (entry);
-          entry = NULL;
-        }
-    }
+/*
+ * Single-threaded version of the dump loop. Articles are read at positions
+ * `range` of `refs` if provided, or of the url pointer list otherwise, and
+ * skipped if they're not in `selection`.
+ */
+static void
+dump_articles_serially (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_blob_ref_t *refs, zim_range_t range, const zim_selection_t *selection)
+{
+  arena_t arena;
 
-  if (!entry)
-    {
-      fprintf (stderr, "zim.c : read_article_at_url() : can't find provided url : %s\n", url);
-      goto cleanup;
-    }
+  arena_init (&arena, ENTRY_ARENA_BLOCK_SIZE);
 
-  if (entry->mime_type == MIME_TYPE_REDIRECT) // redirect
+  for (size_t i = range.start; i < range.end; i++)
     {
-      content = read_article_at_index (archive, entry->redirect_index);
-      goto cleanup;
-    }
+      zim_directory_entry_t entry = { 0 };
+      bool selected = false;
 
-  if (entry->mime_type == MIME_TYPE_REDLINK || entry->mime_type == MIME_TYPE_DELETED) // redlink or deleted page
-    {
-      fprintf (stderr, "zim.c : read_article_at_url() : non-existing or deleted page.\n");
-      goto cleanup;
-    }
+      save_progress (i);
+      arena_reset (&arena);
+
+      if (read_selected_entry_at_index (archive, selection, refs ? refs[i].index : i, &entry, &arena, &selected))
+        {
+          fprintf (stderr, "zim.c : dump_articles_serially() : bogus entry found. Ignoring.\n");
+          continue;
+        }
 
-  content = retrieve_directory_entry_content (archive, entry);
+      if (!selected)
+        continue;
 
+      zim_blob_t content = { 0 };
+      if (should_print_content (archive, &entry, options))
+        retrieve_directory_entry_content (archive, &entry, &content);
 
-  cleanup:
-  if (entry) free_zim_directory_entry (entry);
-  if (file) fclose (file);
-  return content;
+      print_article (archive, &entry, options, content.data, content.len);
+
+      release_blob (archive, &content);
+    }
+
+  arena_free (&arena);
 }
 
 /*
- * Utility to find if a given mime-type is accepted by the comma seperated
- * whitelist provided as option or by default.
+ * Print articles in the order of the title pointer list, reading the list
+ * in a single pass beforehand.
+ *
+ * Return non-zero in case of error.
  */
-static bool
-is_accepted_mimetype (const char *mime_type, const char *mime_type_whitelist)
+static int
+dump_articles_in_title_order (const zim_archive_t *archive, const zim_dump_options_t *options, const zim_selection_t *selection)
 {
-  bool accepted = false;
-  char *list = strdup (mime_type_whitelist);
+  int err = 0;
+  char *copy = NULL;
+  size_t count = archive->header->article_count;
+  zim_blob_ref_t *refs = xalloc ((count + 1) * sizeof (*refs));
 
-  char *accepted_mime_type = strtok (list, ",");
-  while (accepted_mime_type)
+  const char *list = view_at (archive, archive->header->title_ptr_pos, count * 4, &copy);
+  if (!list)
     {
-      if (strncmp (mime_type, accepted_mime_type, strlen (accepted_mime_type)) == 0)
-        {
-          accepted = true;
-          break;
-        }
-      accepted_mime_type = strtok (NULL, ",");
+      err = 1;
+      fprintf (stderr, "zim.c : dump_articles_in_title_order() : corrupted zimfile : can't read title pointer list.\n");
+      goto cleanup;
     }
 
-  free (list);
-  return accepted;
+  for (size_t i = 0; i < count; i++)
+    read_int_from_buf (list + i * 4, 4, &refs[i].index);
+
+  zim_range_t range = { checkpoint.index < count ? checkpoint.index : count, count };
+  if (options->jobs > 1 && options->show_article_content)
+    err = dump_articles_in_parallel (archive, options, refs, range, selection);
+  else
+    dump_articles_serially (archive, options, refs, range, selection);
+
+  cleanup:
+  if (copy) free (copy);
+  free (refs);
+  return err;
 }
 
 /*
@@ -1119,12 +4557,12 @@ is_accepted_mimetype (const char *mime_type, const char *mime_type_whitelist)
  *   </html>
  *   <END_OF_ZIM_ARTICLE>
  * 
- * `content` is only displayed if `show_article_content` is true.
+ * `content` is only displayed if `options->show_article_content` is true.
  *
  * Even then, content will only be shown if the mime-type of the article
  * starts with one of the whitelisted mime-type in the comma seperated list
- * `mime_type_whitelist`. This is a start of the string match and not an
- * exact match because zimfile often contains mime-types like this:
+ * `options->mime_type_whitelist`. This is a start of the string match and
+ * not an exact match because zimfile often contains mime-types like this:
  *
  *   text/plain;charset=UTF-8
  *
@@ -1132,17 +4570,60 @@ is_accepted_mimetype (const char *mime_type, const char *mime_type_whitelist)
  * since I've never seen a "text/plain" document in a zimfile not being
  * encoded in UTF-8 anyway).
  *
+ * Redirects have a `mime-type: none (redirect)` line, followed by
+ * `redirect-target: <url>`, the url of the article they end up at. It's
+ * left out for redirects which loop or lead nowhere. Redirects are resolved
+ * for the whole archive beforehand, see resolve_redirects().
+ *
+ * If `options->cluster_order` is true, articles with content are printed
+ * in the order of their clusters rather than in url order, which avoids
+ * decompressing the same cluster again for each of its articles. If
+ * `options->reorder_window` is non-zero as well, url order is kept by
+ * working on windows of that many articles.
+ *
+ * If `options->jobs` is more than 1, that many threads are used to
+ * decompress articles content, while keeping the same output order.
+ *
+ * If `options->title_order` is true, articles are printed in title order
+ * instead, following the title pointer list.
+ *
+ * If `options->url_prefix` is set, only articles whose url starts with it
+ * are printed, see find_url_prefix_range(). They're found with two binary
+ * searches, since the url pointer list is sorted.
+ *
+ * `options->mime_types` and `options->namespaces` only keep articles with
+ * one of those mime-types and namespaces, and `options->min_size` and
+ * `options->max_size` articles whose content has a size in those bounds.
+ * They're checked on the header of directory entries, before their url and
+ * title are read or their content decompressed, see
+ * read_selected_entry_at_index().
+ *
+ * `options->range_start` and `options->range_end` restrict the dump to
+ * those positions in the url pointer list, and `options->shards_count`
+ * splits it in shards of about the same weight, of which only
+ * `options->shard` is printed. See select_articles().
+ *
+ * If `options->checkpoint_path` is set, progress is saved there regularly,
+ * and the dump starts from it if `options->resume` is true. See
+ * load_checkpoint().
+ *
+ * Without content, directory entries are read front to back when they're
+ * stored in url order, see dump_entries_sequentially().
+ *
  * Return non-zero in case of error.
  *
  */
 int
-dump_all_articles (const char *zimfile_path, bool show_article_content, const char *mime_type_whitelist)
+dump_all_articles (const char *zimfile_path, const zim_dump_options_t *options)
 {
   int err = 0;
-  FILE *file = NULL;
   zim_archive_t *archive = NULL;
 
   archive = new_zim_archive ();
+  archive->cluster_cache->max_size = options->cluster_cache_size;
+  archive->load_pointer_lists = true;
+  archive->resolve_redirects = options->format != ZIM_FORMAT_BINARY;
+  archive->options = options;
   err = zim_parse (zimfile_path, archive);
   if (err)
     {
@@ -1150,99 +4631,161 @@ dump_all_articles (const char *zimfile_path, bool show_article_content, const ch
       goto cleanup;
     }
 
-  file = fopen (archive->path, "r");
-  if (!file)
+  zim_selection_t selection = { 0 };
+  err = select_articles (archive, options, &selection) || load_checkpoint (options);
+  if (err)
+    goto cleanup;
+
+  if (strcmp (checkpoint.order, "url") == 0 && checkpoint.index > selection.range.start)
+    selection.range.start = checkpoint.index < selection.range.end ? checkpoint.index : selection.range.end;
+
+  print_stream_header (options);
+
+  if (options->cluster_order && options->show_article_content)
     {
-      err = 1;
-      fprintf (stderr, "zim.c : dump_all_articles() : can't open file %s\n", archive->path);
+      if (options->reorder_window)
+        err = dump_articles_in_url_windows (archive, options, &selection);
+      else
+        err = dump_articles_in_cluster_order (archive, options, &selection);
+
       goto cleanup;
     }
 
-  for (size_t i = 0; i < archive->header->article_count; i++)
+  if (options->title_order)
     {
-      unsigned long int dir_entry = 0;
+      err = dump_articles_in_title_order (archive, options, &selection);
+      goto cleanup;
+    }
 
-      if (fseek (file, archive->header->url_ptr_pos + i * 8, SEEK_SET) == -1)
-        {
-          err = 1;
-          fprintf (stderr, "zim.c : dump_all_articles() : can't seek file to url pointer\n");
-          goto cleanup;
-        }
+  if (!options->show_article_content && dump_entries_sequentially (archive, options, &selection) == 0)
+    goto cleanup;
 
-      err = read_int (file, 8, &dir_entry);
-      if (err)
-        {
-          fprintf (stderr, "zim.c : dump_all_articles() : can't read url pointer\n");
-          goto cleanup;
-        }
+  if (options->jobs > 1 && options->show_article_content)
+    {
+      err = dump_articles_in_parallel (archive, options, NULL, selection.range, &selection);
+      goto cleanup;
+    }
+
+  dump_articles_serially (archive, options, NULL, selection.range, &selection);
+
+  cleanup:
+  if (!err && standard_output.buf) finish_checkpoint (archive);
+  if (print_stream_end ()) err = 1;
+  if (archive) free_zim_archive (archive);
+  return err;
+}
+
+/*
+ * Find the entry for one line of the list given to dump_listed_articles(),
+ * following redirects. The entry is allocated from `arena`, or from the
+ * heap if it's NULL.
+ *
+ * Return NULL if it can't be found.
+ */
+static zim_directory_entry_t *
+find_listed_entry (const zim_archive_t *archive, const char *line, bool by_index, arena_t *arena)
+{
+  int err = 0;
+  zim_directory_entry_t *entry = new_zim_directory_entry (arena);
 
-      if (fseek (file, dir_entry, SEEK_SET) == -1)
+  if (by_index)
+    {
+      char *end = NULL;
+      unsigned long int index = strtoul (line, &end, 10);
+      if (end == line || *end)
         {
           err = 1;
-          fprintf (stderr, "zim.c : dump_all_articles() : can't seek file to dir entry\n");
+          fprintf (stderr, "zim.c : find_listed_entry() : invalid index : %s\n", line);
           goto cleanup;
         }
 
-      zim_directory_entry_t *entry = xalloc (sizeof (*entry));
-      err = parse_directory_entry (file, entry);
-      if (err)
-        {
-          fprintf (stderr, "zim.c : dump_all_articles() : bogus entry found. Ignoring.\n");
-          free_zim_directory_entry (entry);
-          continue;
-        }
+      err = read_directory_entry_at_index (archive, index, entry, arena);
+    }
+  else
+    err = find_in_index (archive, URL_INDEX, line, entry, arena);
 
-      puts ("<START_OF_ZIM_ARTICLE>");
-      printf ("url: %s\n", entry->url);
-      printf ("title: %s\n", entry->title);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : find_listed_entry() : can't find provided %s : %s\n", by_index ? "index" : "url", line);
+      goto cleanup;
+    }
 
-      if (entry->mime_type < archive->mime_type_list->len)
-        {
-          const char *mime_type = archive->mime_type_list->items[entry->mime_type];
-          printf ("mime-type: %s\n", mime_type);
+  err = follow_redirects (archive, entry, arena);
 
-          if (show_article_content)
-            {
-              if (is_accepted_mimetype (mime_type, mime_type_whitelist))
-                {
-                  puts ("content:");
-                  char *content = read_article_at_url (archive, entry->url);
-                  if (content)
-                    {
-                      puts (content);
-                      free (content);
-                    }
-                  else
-                    fprintf (stderr, "zim.c : dump_all_articles() : can't find content for this article.");
-                }
-              else
-                puts ("content:\nNOT-WHITELISTED-MIME-TYPE");
-            }
-        }
-      else
-        {
-          switch (entry->mime_type)
-            {
-              case MIME_TYPE_REDIRECT:
-                puts ("mime-type: none (redirect)");
-                break;
+  cleanup:
+  if (err)
+    {
+      if (!arena) free_zim_directory_entry (entry);
+      entry = NULL;
+    }
 
-              case MIME_TYPE_REDLINK:
-              case MIME_TYPE_DELETED:
-                puts ("mime-type: none (deleted page)");
-                break;
+  return entry;
+}
 
-              default:
-                puts ("mime-type: unknown");
-            }
-        }
+/*
+ * Print articles listed in `list`, one url per line, or one position in
+ * the url pointer list if `by_index` is true.
+ *
+ * Articles are printed in the format of dump_all_articles(), in the order
+ * of the list. Redirects are followed, so the target article is printed.
+ * Articles which can't be found are reported on STDERR and skipped.
+ *
+ * Lookups are done by windows of `options->reorder_window` lines (or
+ * BATCH_WINDOW_SIZE by default) : the clusters needed by a window are
+ * decompressed once each, in cluster order.
+ *
+ * Return non-zero in case of error.
+ */
+int
+dump_listed_articles (const char *zimfile_path, FILE *list, bool by_index, const zim_dump_options_t *options)
+{
+  int err = 0;
+  zim_archive_t *archive = NULL;
+  reorder_window_t window = { 0 };
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t line_len = 0;
+
+  archive = new_zim_archive ();
+  archive->cluster_cache->max_size = options->cluster_cache_size;
+  archive->load_pointer_lists = true;
+  archive->resolve_redirects = true;
+  archive->partial_clusters = true;
+  archive->options = options;
+  err = zim_parse (zimfile_path, archive);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : dump_listed_articles() : can't parse %s. Is it a zim file?\n", zimfile_path);
+      goto cleanup;
+    }
+
+  print_stream_header (options);
 
-      puts ("<END_OF_ZIM_ARTICLE>");
-      free_zim_directory_entry (entry);
+  init_reorder_window (&window, options->reorder_window ? options->reorder_window : BATCH_WINDOW_SIZE);
+
+  while ((line_len = getline (&line, &line_size, list)) != -1)
+    {
+      while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+        line[--line_len] = 0;
+
+      if (line_len == 0)
+        continue;
+
+      zim_directory_entry_t *entry = find_listed_entry (archive, line, by_index, &window.arena);
+      if (!entry)
+        continue;
+
+      window.entries[window.len++] = entry;
+      if (window.len == window.size)
+        flush_reorder_window (archive, options, &window);
     }
 
+  flush_reorder_window (archive, options, &window);
+
   cleanup:
-  if (file) fclose (file);
+  if (print_stream_end ()) err = 1;
+  if (window.entries) free_reorder_window (&window);
+  if (line) free (line);
   if (archive) free_zim_archive (archive);
   return err;
 }
@@ -1277,39 +4820,200 @@ dump_mime_types (const char *zimfile_path)
   return err;
 }
 
+typedef int (*article_finder_t) (zim_archive_t *archive, const char *key, zim_directory_entry_t *entry);
+
 /*
- * Print the content of a given article at `url`.
- *
- * `url` is the name of the document, which can be retrieve from
- * dump_all_articles().
+ * Print the content of the article `finder` finds for `key`. It's written
+ * as it's decompressed, see stream_blob(), so articles of any size can be
+ * printed.
  *
  * Return non-zero in case of error.
  */
-int
-show_article (const char *zimfile_path, const char *url)
+static int
+print_article_content (const char *zimfile_path, const char *key, article_finder_t finder, const zim_dump_options_t *options)
 {
   int err = 0;
   zim_archive_t *archive = NULL;
-  char *article = NULL;
+  zim_directory_entry_t *entry = NULL;
+  output_t out = { 0 };
 
   archive = new_zim_archive ();
+  archive->cluster_cache->max_size = options->cluster_cache_size;
   err = zim_parse (zimfile_path, archive);
   if (err)
     {
-      fprintf (stderr, "zim.c : show_article() : can't parse %s. Is it a zim file?\n", zimfile_path);
+      fprintf (stderr, "zim.c : print_article_content() : can't parse %s. Is it a zim file?\n", zimfile_path);
+      goto cleanup;
+    }
+
+  entry = xalloc (sizeof (*entry));
+  err = finder (archive, key, entry);
+  if (err)
+    {
+      fprintf (stderr, "zim.c : print_article_content() : can't read article.\n");
       goto cleanup;
     }
 
-  article = read_article_at_url (archive, url);
-  if (!article)
+  output_init (&out, STDOUT_FILENO);
+  err = stream_blob (archive, entry, &out);
+  if (err)
     {
-      fprintf (stderr, "zim.c : show_article() : can't read article.\n");
+      fprintf (stderr, "zim.c : print_article_content() : can't read article.\n");
       goto cleanup;
     }
 
-  puts (article);
+  output_write (&out, "\n", 1);
+  stats_count (STATS_ARTICLES, 1);
 
   cleanup:
-  if (article) free (article);
+  if (out.buf && output_close (&out)) err = 1;
+  if (entry) free_zim_directory_entry (entry);
+  if (archive) free_zim_archive (archive);
   return err;
 }
+
+/*
+ * Print the content of a given article at `url`.
+ *
+ * `url` is the name of the document, which can be retrieve from
+ * dump_all_articles().
+ *
+ * Return non-zero in case of error.
+ */
+int
+show_article (const char *zimfile_path, const char *url, const zim_dump_options_t *options)
+{
+  return print_article_content (zimfile_path, url, find_article_at_url, options);
+}
+
+/*
+ * Print the content of the article titled `title`.
+ *
+ * Return non-zero in case of error.
+ */
+int
+show_article_by_title (const char *zimfile_path, const char *title, const zim_dump_options_t *options)
+{
+  return print_article_content (zimfile_path, title, find_article_at_title, options);
+}
+
+/*
+ * Open the zimfile at `path` for repeated lookups, with its pointer lists
+ * loaded, its redirects resolved and a cluster cache of
+ * `options->cluster_cache_size` bytes. Clusters are only decompressed as
+ * far as lookups need, see get_cluster().
+ *
+ * The archive can be used from several threads at once. Close it with
+ * zim_close().
+ *
+ * Return NULL in case of error.
+ */
+zim_archive_t *
+zim_open (const char *path, const zim_dump_options_t *options)
+{
+  zim_archive_t *archive = new_zim_archive ();
+  archive->cluster_cache->max_size = options->cluster_cache_size;
+  archive->load_pointer_lists = true;
+  archive->resolve_redirects = true;
+  archive->partial_clusters = true;
+
+  if (zim_parse (path, archive))
+    {
+      fprintf (stderr, "zim.c : zim_open() : can't parse %s. Is it a zim file?\n", path);
+      free_zim_archive (archive);
+      return NULL;
+    }
+
+  return archive;
+}
+
+void
+zim_close (zim_archive_t *archive)
+{
+  free_zim_archive (archive);
+}
+
+typedef struct {
+  zim_directory_entry_t *entry;
+  zim_blob_t blob;
+} zim_article_handle_t;
+
+/*
+ * Read the article at url `key`, or at position `key` in the url list if
+ * `by_index` is true, following redirects.
+ *
+ * `article` must be released with zim_release_article().
+ *
+ * Return non-zero if there is no such article, or in case of error.
+ */
+int
+zim_read_article (zim_archive_t *archive, const char *key, bool by_index, zim_article_t *article)
+{
+  zim_article_handle_t *handle = xalloc (sizeof (*handle));
+
+  handle->entry = find_listed_entry (archive, key, by_index, NULL);
+  if (!handle->entry
+      || handle->entry->mime_type >= archive->mime_type_list->len
+      || retrieve_directory_entry_content (archive, handle->entry, &handle->blob))
+    {
+      if (handle->entry) free_zim_directory_entry (handle->entry);
+      free (handle);
+      return 1;
+    }
+
+  article->url = handle->entry->url;
+  article->title = handle->entry->title;
+  article->mime_type = archive->mime_type_list->items[handle->entry->mime_type];
+  article->data = handle->blob.data;
+  article->len = handle->blob.len;
+  article->handle = handle;
+  return 0;
+}
+
+void
+zim_release_article (zim_archive_t *archive, zim_article_t *article)
+{
+  zim_article_handle_t *handle = article->handle;
+  if (!handle) return;
+
+  release_blob (archive, &handle->blob);
+  free_zim_directory_entry (handle->entry);
+  free (handle);
+  article->handle = NULL;
+}
+
+/*
+ * Print url, title and mime-type of articles on file descriptor `fd`, in
+ * the format of dump_all_articles(). Only articles whose url starts with
+ * `prefix` are printed if it's not NULL, see find_url_prefix_range().
+ *
+ * Return non-zero in case of error.
+ */
+int
+zim_list_articles (zim_archive_t *archive, const char *prefix, int fd)
+{
+  zim_dump_options_t options = { 0 };
+  zim_range_t range = { 0, archive->header->article_count };
+  output_t out;
+  arena_t arena;
+
+  if (prefix && find_url_prefix_range (archive, prefix, &range))
+    return 1;
+
+  output_init (&out, fd);
+  arena_init (&arena, ENTRY_ARENA_BLOCK_SIZE);
+
+  for (size_t i = range.start; i < range.end; i++)
+    {
+      zim_directory_entry_t entry = { 0 };
+
+      arena_reset (&arena);
+      if (read_directory_entry_at_index (archive, i, &entry, &arena))
+        fprintf (stderr, "zim.c : zim_list_articles() : bogus entry found. Ignoring.\n");
+      else
+        fprint_article (&out, archive, &entry, &options, NULL, 0, &arena);
+    }
+
+  arena_free (&arena);
+  return output_close (&out);
+}
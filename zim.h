@@ -2,9 +2,62 @@
 #define ZIM_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
-int dump_all_articles (const char *zimfile_path, bool show_article_content, const char *mime_type_whitelist);
+typedef struct zim_archive_s zim_archive_t;
+
+typedef enum {
+  ZIM_FORMAT_TEXT,
+  ZIM_FORMAT_BINARY,
+  ZIM_FORMAT_JSONL,
+} zim_output_format_t;
+
+typedef struct {
+  bool show_article_content;
+  const char *mime_type_whitelist;
+  const char *mime_types;
+  const char *namespaces;
+  size_t min_size;
+  size_t max_size;
+  bool cluster_order;
+  bool title_order;
+  const char *url_prefix;
+  size_t range_start;
+  size_t range_end;
+  size_t shard;
+  size_t shards_count;
+  const char *checkpoint_path;
+  bool resume;
+  size_t reorder_window;
+  size_t cluster_cache_size;
+  size_t jobs;
+  zim_output_format_t format;
+} zim_dump_options_t;
+
+/*
+ * Article read by zim_read_article(). `data` is not NUL terminated. All
+ * fields are valid until zim_release_article().
+ */
+typedef struct {
+  const char *url;
+  const char *title;
+  const char *mime_type;
+  const char *data;
+  size_t len;
+  void *handle;
+} zim_article_t;
+
+int dump_all_articles (const char *zimfile_path, const zim_dump_options_t *options);
+int dump_listed_articles (const char *zimfile_path, FILE *list, bool by_index, const zim_dump_options_t *options);
 int dump_mime_types (const char *zimfile_path);
-int show_article (const char *zimfile_path, const char *url);
+int show_article (const char *zimfile_path, const char *url, const zim_dump_options_t *options);
+int show_article_by_title (const char *zimfile_path, const char *title, const zim_dump_options_t *options);
+
+zim_archive_t *zim_open (const char *path, const zim_dump_options_t *options);
+void zim_close (zim_archive_t *archive);
+int zim_read_article (zim_archive_t *archive, const char *key, bool by_index, zim_article_t *article);
+void zim_release_article (zim_archive_t *archive, zim_article_t *article);
+int zim_list_articles (zim_archive_t *archive, const char *prefix, int fd);
 
 #endif